@@ -29,6 +29,7 @@
 
 #define ACT_FORMAT 1		/* Convert format from old to new */
 #define ACT_ENDIAN 2		/* Convert endianity */
+#define ACT_COMPACT 3		/* Rewrite file without free space */
 
 static char *mntpoint;
 char *progname;
@@ -36,6 +37,8 @@ static int ucv, gcv;
 static struct quota_handle *qn;	/* Handle of new file */
 static int action;			/* Action to be performed */
 static int infmt, outfmt;
+static struct dquot *compact_dquots;	/* Dquots read from file being compacted */
+static uint compact_cnt, compact_size;
 
 static void usage(void)
 {
@@ -44,6 +47,7 @@ static void usage(void)
 -g, --group                         convert group quota file\n\
 -e, --convert-endian                convert quota file to correct endianity\n\
 -f, --convert-format oldfmt,newfmt  convert from old to VFSv0 quota format\n\
+-c, --compact                       rewrite quota file without unused space\n\
 -h, --help                          show this help text and exit\n\
 -V, --version                       output version information and exit\n\n"), progname);
 	errstr(_("Bugs to %s\n"), PACKAGE_BUGREPORT);
@@ -69,12 +73,13 @@ static void parse_options(int argcnt, char **argstr)
 		{ "group", 0, NULL, 'g'},
 		{ "convert-endian", 0, NULL, 'e'},
 		{ "convert-format", 1, NULL, 'f'},
+		{ "compact", 0, NULL, 'c'},
 		{ NULL, 0, NULL, 0}
 	};
 	char *comma;
 	char fmtbuf[MAX_FMTNAME_LEN];
 
-	while ((ret = getopt_long(argcnt, argstr, "Vugef:h", long_opts, NULL)) != -1) {
+	while ((ret = getopt_long(argcnt, argstr, "Vugecf:h", long_opts, NULL)) != -1) {
 		switch (ret) {
 			case '?':
 			case 'h':
@@ -91,6 +96,9 @@ static void parse_options(int argcnt, char **argstr)
 			case 'e':
 				action = ACT_ENDIAN;
 				break;
+			case 'c':
+				action = ACT_COMPACT;
+				break;
 			case 'f':
 				action = ACT_FORMAT;
 				comma = strchr(optarg, ',');
@@ -371,6 +379,131 @@ static int convert_endian(int type, struct mount_entry *mnt)
 	return rename_file(type, QF_VFSV0, mnt);
 }
 
+/*
+ *	Compaction of quota file
+ */
+
+static int compact_store_dquot(struct dquot *dquot, char *name)
+{
+	if (compact_cnt == compact_size) {
+		compact_size = compact_size ? compact_size * 2 : 1024;
+		compact_dquots = srealloc(compact_dquots, sizeof(struct dquot) * compact_size);
+	}
+	compact_dquots[compact_cnt++] = *dquot;
+	return 0;
+}
+
+static int compact_cmp_dquot(const void *a, const void *b)
+{
+	const struct dquot *d1 = a, *d2 = b;
+
+	if (d1->dq_id != d2->dq_id)
+		return d1->dq_id < d2->dq_id ? -1 : 1;
+	return 0;
+}
+
+/* Write all dquots of the old file into a new one */
+static int compact_write(int type, struct mount_entry *mnt, int *fmt)
+{
+	struct quota_handle *qo;
+	struct dquot **sorted;
+	uint i;
+	int ret = 0;
+
+	if (!(qo = init_io(mnt, type, -1, 0))) {
+		errstr(_("Cannot open quota file for %ss on %s\n"),
+			_(type2name(type)), mnt->me_dir);
+		return -1;
+	}
+	if (!is_tree_qfmt(qo->qh_fmt)) {
+		errstr(_("Only quota files in vfsv0 and vfsv1 formats can be compacted.\n"));
+		end_io(qo);
+		return -1;
+	}
+	*fmt = qo->qh_fmt;
+	compact_cnt = 0;
+	if (qo->qh_ops->scan_dquots(qo, compact_store_dquot) < 0) {
+		errstr(_("Cannot read quota file for %ss on %s: %s\n"),
+			_(type2name(type)), mnt->me_dir, strerror(errno));
+		end_io(qo);
+		return -1;
+	}
+	if (!(qn = new_io(mnt, type, *fmt))) {
+		errstr(_("Cannot create new quota file for %ss on %s: %s\n"),
+			_(type2name(type)), mnt->me_dir, strerror(errno));
+		end_io(qo);
+		return -1;
+	}
+	qn->qh_info.dqi_bgrace = qo->qh_info.dqi_bgrace;
+	qn->qh_info.dqi_igrace = qo->qh_info.dqi_igrace;
+	qn->qh_info.u.v2_mdqi.dqi_flags = qo->qh_info.u.v2_mdqi.dqi_flags;
+	mark_quotafile_info_dirty(qn);
+	end_io(qo);
+
+	/* The new file gets entries packed in the order of ids */
+	qsort(compact_dquots, compact_cnt, sizeof(struct dquot), compact_cmp_dquot);
+	sorted = smalloc(sizeof(struct dquot *) * (compact_cnt + 1));
+	for (i = 0; i < compact_cnt; i++) {
+		compact_dquots[i].dq_h = qn;
+		sorted[i] = compact_dquots + i;
+	}
+	if (qn->qh_ops->commit_dquots(qn, sorted, compact_cnt) < 0) {
+		errstr(_("Cannot write new quota file for %ss on %s: %s\n"),
+			_(type2name(type)), mnt->me_dir, strerror(errno));
+		ret = -1;
+	}
+	free(sorted);
+	if (end_io(qn) < 0)
+		ret = -1;
+	qn = NULL;
+	return ret;
+}
+
+/*
+ * Rewrite quota file so that entries are packed densely in the order of ids
+ * and there are no free blocks. If kernel uses the file, quotas are turned
+ * off while the file is rewritten and renamed.
+ */
+static int compact_file(int type, struct mount_entry *mnt)
+{
+	char *qfname = NULL;
+	int ret, fmt, kernfmt;
+
+	kernfmt = kern_quota_on(mnt, type, -1);
+	if (kernfmt >= 0) {
+		if (!is_tree_qfmt(kernfmt)) {
+			errstr(_("Only quota files in vfsv0 and vfsv1 formats can be compacted.\n"));
+			return -1;
+		}
+		if (get_qf_name(mnt, type, kernfmt, NF_FORMAT, &qfname) < 0) {
+			errstr(_("Cannot find %s quota file used by kernel on %s.\n"),
+				_(type2name(type)), mnt->me_dir);
+			return -1;
+		}
+		if (quotactl_mnt(Q_QUOTAOFF, type, mnt, 0, NULL) < 0) {
+			errstr(_("Cannot turn %s quotas off on %s: %s\n"),
+				_(type2name(type)), mnt->me_dir, strerror(errno));
+			free(qfname);
+			return -1;
+		}
+	}
+	ret = compact_write(type, mnt, &fmt);
+	if (!ret)
+		ret = rename_file(type, fmt, mnt);
+	free(compact_dquots);
+	compact_dquots = NULL;
+	compact_size = 0;
+	if (kernfmt >= 0) {
+		if (quotactl_mnt(Q_QUOTAON, type, mnt, util2kernfmt(kernfmt), qfname) < 0) {
+			errstr(_("Cannot turn %s quotas on on %s: %s\n"),
+				_(type2name(type)), mnt->me_dir, strerror(errno));
+			ret = -1;
+		}
+		free(qfname);
+	}
+	return ret;
+}
+
 static int convert_file(int type, struct mount_entry *mnt)
 {
 	switch (action) {
@@ -378,6 +511,8 @@ static int convert_file(int type, struct mount_entry *mnt)
 			return convert_format(type, mnt);
 		case ACT_ENDIAN:
 			return convert_endian(type, mnt);
+		case ACT_COMPACT:
+			return compact_file(type, mnt);
 	}
 	errstr(_("Unknown action should be performed.\n"));
 	return -1;
@@ -169,18 +169,26 @@ static int parse_options(int argc, char **argv)
 
 static void copy_prototype(int argc, char **argv, struct quota_handle **handles)
 {
-	int ret, protoid, id;
+	int ret, protoid, i;
+	int *ids;
 	struct dquot *protoprivs, *curprivs, *pprivs, *cprivs;
 	
 	ret = 0;
 	protoid = name2id(protoname, quotatype, !!(flags & FL_NUMNAMES), NULL);
 	protoprivs = getprivs(protoid, handles, 0);
-	while (argc-- > 0) {
-		id = name2id(*argv, quotatype, !!(flags & FL_NUMNAMES), NULL);
-		curprivs = getprivs(id, handles, !dir_name);
-		if (!curprivs)
-			die(1, _("Cannot get quota information for user %s\n"), *argv);
-		argv++;
+	/* Translate all names first so that a bad name doesn't stop us in the middle */
+	ids = smalloc(sizeof(int) * (argc ? argc : 1));
+	for (i = 0; i < argc; i++)
+		ids[i] = name2id(argv[i], quotatype, !!(flags & FL_NUMNAMES), NULL);
+	/* Changed quota structures are written together at the end */
+	for (i = 0; handles[i]; i++)
+		begin_batch(handles[i]);
+	for (i = 0; i < argc; i++) {
+		curprivs = getprivs(ids[i], handles, !dir_name);
+		if (!curprivs) {
+			dispose_handle_list(handles);
+			die(1, _("Cannot get quota information for user %s\n"), argv[i]);
+		}
 
 		for (pprivs = protoprivs, cprivs = curprivs; pprivs && cprivs;
 		     pprivs = pprivs->dq_next, cprivs = cprivs->dq_next) {
@@ -202,6 +210,7 @@ static void copy_prototype(int argc, char **argv, struct quota_handle **handles)
 			ret = -1;
 		freeprivs(curprivs);
 	}
+	free(ids);
 	if (dispose_handle_list(handles) == -1)
 		ret = -1;
 	freeprivs(protoprivs);
@@ -22,6 +22,7 @@ struct qt_disk_dqdbheader {
 } __attribute__ ((packed));
 
 struct dquot;
+struct dquot_batch;
 struct quota_handle;
 
 /* Operations */
@@ -40,11 +41,17 @@ struct qtree_mem_dqinfo {
 	struct qtree_fmt_operations *dqi_ops;	/* Operations for entry manipulation */
 };
 
-void qtree_write_dquot(struct dquot *dquot);
+int qtree_write_dquot(struct dquot *dquot);
+int qtree_write_dquots(struct quota_handle *h, struct dquot **dquots, int count);
 struct dquot *qtree_read_dquot(struct quota_handle *h, qid_t id);
-void qtree_delete_dquot(struct dquot *dquot);
+int qtree_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots);
+int qtree_delete_dquot(struct dquot *dquot);
 int qtree_entry_unused(struct qtree_mem_dqinfo *info, char *disk);
 int qtree_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *, char *));
+int qtree_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *));
+int qtree_flush_cache(struct quota_handle *h);
+int qtree_free_cache(struct quota_handle *h);
+int qtree_end_batch(struct quota_handle *h);
 
 int qtree_dqstr_in_blk(struct qtree_mem_dqinfo *info);
 
@@ -14,20 +14,52 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/file.h>
 #include <sys/statfs.h>
+#include <sys/statvfs.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/utsname.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#ifdef HAVE_FANOTIFY
+#include <poll.h>
+#include <sys/fanotify.h>
+#endif
+
+#include <linux/fs.h>
+
+#ifndef FS_IOC_FSGETXATTR
+#define FS_IOC_FSGETXATTR		_IOR ('X', 31, struct fsxattr)
+
+struct fsxattr {
+	__u32		fsx_xflags;	/* xflags field value (get/set) */
+	__u32		fsx_extsize;	/* extsize field value (get/set)*/
+	__u32		fsx_nextents;	/* nextents field value (get)	*/
+	__u32		fsx_projid;	/* project identifier (get/set) */
+	__u32		fsx_cowextsize;	/* CoW extsize field value (get/set)*/
+	unsigned char	fsx_pad[8];
+};
+#endif
+
+#ifndef FS_XFLAG_PROJINHERIT
+#define FS_XFLAG_PROJINHERIT	0x00000200	/* create with parents projid */
+#endif
 
 #ifdef EXT2_DIRECT
 #include <linux/types.h>
@@ -37,23 +69,194 @@
 #include "pot.h"
 #include "common.h"
 #include "quotaio.h"
+#include "quotaio_generic.h"
 #include "quotasys.h"
 #include "mntopt.h"
 #include "bylabel.h"
 #include "quotacheck.h"
 #include "quotaops.h"
 
-#define LINKSHASHSIZE 16384	/* Size of hashtable for hardlinked inodes */
-#define DQUOTHASHSIZE 32768	/* Size of hashtable for dquots from file */
+#define ARENA_CHUNK_SIZE (64 * 1024)	/* Size of memory chunks arenas allocate */
+#define ARENA_ALIGN 16		/* Alignment of objects allocated from arenas */
+#define LINKSHARDS 256		/* Number of independently locked parts of hardlink table */
+#define LINKSHARD_MINSIZE 64	/* Minimal size of a part of hardlink table */
+#define DQUOTHASH_MINSIZE 256	/* Initial size of hashtable for dquots */
+#define MAXSCANTHREADS 256	/* Maximal number of threads scanning the filesystem */
+#define MAXCHECKJOBS 256	/* Maximal number of filesystems checked in parallel */
+#define MAXOPENDIRS 64		/* Maximal number of directories a walker keeps open */
+#define SCAN_IDLE_WAIT 10000000	/* How long (in ns) idle worker waits before looking for work again */
+#define CHECKPOINT_INTERVAL 300	/* Default number of seconds between checkpoints */
+#define CHECKPOINT_MAGIC "QCCKPT02"	/* Identifies checkpoint file (and its version) */
+#define PROGRESS_INTERVAL 1	/* Seconds between progress reports */
+#define PUSH_THREADS 8		/* Threads passing changed usage to the kernel */
+#define PUSH_BATCH 64		/* Number of ids a pushing thread takes at once */
+#define ONLINE_POLL_MS 100	/* How often thread reading changes checks for end of scan */
+#define ONLINE_EVENT_BUF 65536	/* Size of buffer for reading change events */
+
+/* Chunk of memory of an arena */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;			/* Number of used bytes in data */
+	char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+/* Allocator of objects which are all freed at once */
+struct arena {
+	struct arena_chunk *chunks;	/* Allocated chunks, we allocate from the first one */
+	size_t size;			/* Total size of chunks */
+};
+
+/* Hashtable of dquots of one quota type */
+struct dquot_table {
+	struct dquot **hash;		/* Hash chains */
+	uint size;			/* Number of chains (power of two) */
+	uint count;			/* Number of dquots in the table */
+};
 
+/* Hardlinked inode not all links of which have been seen yet */
 struct dlinks {
-	ino_t i_num;
-	struct dlinks *next;
+	ino_t i_num;		/* Inode number, 0 for free slot */
+	nlink_t seen;		/* Number of links seen so far */
+};
+
+/* Part of open addressed hashtable of hardlinked inodes */
+struct dlinks_shard {
+	pthread_mutex_t lock;	/* Protects the shard during parallel scan */
+	struct dlinks *table;
+	uint size, used;	/* Size of the table (power of two), number of used slots */
+};
+
+/* Inode counted during online check together with what it was counted to */
+struct online_inode {
+	ino_t i_num;		/* Inode number, 0 for free slot */
+	uid_t uid;
+	gid_t gid;
+	qid_t prjid;
+	loff_t space;
+};
+
+/* Part of open addressed hashtable of inodes counted during online check */
+struct online_shard {
+	pthread_mutex_t lock;	/* Protects the shard during parallel scan */
+	struct online_inode *table;
+	uint size, used;	/* Size of the table (power of two), number of used slots */
+};
+
+/* Inode changed during online check */
+struct online_change {
+	ino_t i_num;		/* Inode number, 0 for free slot */
+	struct file_handle *fh;	/* Handle to find the inode after the scan */
+};
+
+/* Directory on the stack of directory tree walker */
+struct scan_frame {
+	int fd;			/* Open directory, -1 when closed to save descriptors */
+	size_t name;		/* Offset of the name of the directory in names arena */
+	size_t start;		/* Where names of subdirectories start in names arena */
+	size_t next, end;	/* Names of subdirectories waiting for scan */
+	qid_t projid;		/* Project ID of the directory */
+	int projinherit;	/* Do new inodes inherit the project ID? */
+};
+
+/* Directory entry waiting for stat when sorting by inode numbers */
+struct scan_dirent {
+	ino_t ino;
+	size_t name;		/* Offset of the name in dirent names buffer */
+};
+
+/* State of a walk through directory tree */
+struct scan_walker {
+	struct scan_frame *frames;	/* Stack of directories being scanned */
+	int depth, frames_size;
+	int closed;			/* Number of closed directories at the bottom of the stack */
+	char *names;			/* Arena with names of directories */
+	size_t names_len, names_size;
+	int verbose;			/* Does this walker update progress output? */
+	struct scan_dirent *ents;	/* Entries of directory being read sorted by inode */
+	size_t ents_len, ents_size;
+	char *entnames;			/* Names of the entries */
+	size_t entnames_len, entnames_size;
+	struct dquot_table *dquot_hash;	/* Where usage is gathered (MAXQUOTAS tables) */
+	struct arena arena;		/* Arena for dquots of this walker */
+	int files_done, dirs_done;
+	pthread_mutex_t lock;		/* Protects stack and names against thieves */
+};
+
+/* State of one thread of parallel filesystem scan */
+struct scan_worker {
+	pthread_t thread;
+	int idx;			/* Index of the worker in scan_workers[] */
+	const char *start;		/* Directory to start the scan in */
+	struct scan_walker walk;
 };
 
-struct dirs {
-	char *dir_name;
-	struct dirs *next;
+/* State of filesystem which must not change between checkpoint and resume */
+struct fs_state {
+	uint64_t dev;			/* Device of the filesystem */
+	uint64_t blocks, bfree;		/* Numbers of blocks and free blocks */
+	uint64_t files, ffree;		/* Numbers of inodes and free inodes */
+	uint64_t sb_wtime;		/* Last superblock write time (ext2/3/4) */
+	uint64_t sb_mnt_count;		/* Mount count (ext2/3/4) */
+	uint64_t sb_kbytes_written;	/* Lifetime writes (ext4) */
+};
+
+/* Header of checkpoint file, followed by stack, names, usage and hardlinks */
+struct checkpoint_header {
+	char magic[8];
+	struct fs_state fs;
+	int32_t check[MAXQUOTAS];	/* Which quota types are checked */
+	int32_t files_done, dirs_done;
+	int32_t depth;			/* Depth of walker stack */
+	uint64_t names_len;		/* Length of names arena */
+	uint32_t dquots[MAXQUOTAS];	/* Numbers of dquots of each type */
+	uint64_t links;			/* Number of hardlinked inodes */
+};
+
+/* Walker stack frame as stored in checkpoint */
+struct checkpoint_frame {
+	uint64_t name, start, next, end;
+	uint32_t projid;
+	uint32_t projinherit;
+};
+
+/* Usage of one id as stored in checkpoint */
+struct checkpoint_dquot {
+	uint32_t id;
+	int64_t curinodes, curspace;
+};
+
+/* Hardlinked inode as stored in checkpoint */
+struct checkpoint_link {
+	uint64_t i_num;
+	uint64_t seen;
+};
+
+/* Phases of a check reported in progress output */
+enum {
+	PHASE_LOAD,		/* Reading of old quota files */
+	PHASE_SCAN,		/* Scan of the filesystem */
+	PHASE_DUMP,		/* Writing of new usage */
+	PHASE_RENAME,		/* Renaming of quota files and turning quotas back on */
+	PHASE_COUNT
+};
+
+static const char *phase_names[PHASE_COUNT] = { "load", "scan", "dump", "rename" };
+
+/* State of progress reporting */
+struct progress {
+	int fd;				/* Where to report progress, -1 if not reporting */
+	pthread_t thread;		/* Thread reporting progress periodically */
+	pthread_mutex_t lock;		/* Protects phase times and output */
+	pthread_cond_t cond;		/* Wakes reporting thread when check ends */
+	int stop;			/* Should the reporting thread exit? */
+	const char *dir;		/* Filesystem being checked */
+	int phase;			/* Current phase */
+	double start, phase_start;	/* When check and current phase started */
+	double phase_times[PHASE_COUNT];	/* Time spent in finished phases */
+	double last_time;		/* Time of the previous report */
+	uint64_t last_inodes;		/* Inodes counted at the previous report */
+	uint64_t inodes, bytes;		/* Inodes and bytes accounted so far */
+	long queued;			/* Directories waiting for scan */
 };
 
 #define BITS_SIZE 4		/* sizeof(bits) == 5 */
@@ -62,21 +265,50 @@ struct dirs {
 static dev_t cur_dev;			/* Device we are working on */
 static int files_done, dirs_done;
 int flags, fmt = -1, cfmt;	/* Options from command line; Quota format to use spec. by user; Actual format to check */
-static int uwant, gwant, ucheck, gcheck;	/* Does user want to check user/group quota; Do we check user/group quota? */
+static int uwant, gwant, pwant, ucheck, gcheck, pcheck;	/* Does user want to check user/group/project quota; Do we check user/group/project quota? */
+static int scan_threads = 1;		/* Number of threads scanning the filesystem */
+static int check_jobs = 1;		/* Number of devices checked in parallel */
+static int qsize_ioctl;			/* Do we need FIOQSIZE to get exact space usage? */
+static int max_open_dirs;		/* Number of directories a walker can keep open */
 static char *mntpoint;			/* Mountpoint to check */
+static char *subtree;			/* Directory tree to recount */
+static char *save_usage_file;		/* Where to save usage of the subtree */
+static char *replaced_file;		/* Saved usage of what the subtree replaced */
+static char *checkpoint_file;		/* Where to save scan progress */
+static int checkpoint_interval = CHECKPOINT_INTERVAL;	/* Seconds between checkpoints */
+static int resume;			/* Resume scan from checkpoint? */
+static int inplace_ok[MAXQUOTAS];	/* Can quota file be updated in place? */
+static qid_t *changed_ids;		/* Ids whose usage differs from quota file */
+static uint changed_cnt, changed_size, compared_cnt;
+static int changed_type;		/* Type of quota file being compared */
+static int checkpointing;		/* Are checkpoints written during current scan? */
+static time_t next_checkpoint;		/* When to write next checkpoint */
+static struct fs_state scan_fs_state;	/* State of the filesystem being scanned */
+static volatile sig_atomic_t scan_interrupted;	/* Got signal asking us to stop? */
+static size_t dquot_mem;		/* Memory used by dquots and their hashtables */
+static struct progress progress = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
 char *progname;
 struct util_dqinfo old_info[MAXQUOTAS];	/* Loaded infos */
 
 static char extensions[MAXQUOTAS + 2][20] = INITQFNAMES;	/* Extensions depending on quota type */
 static char *basenames[] = INITQFBASENAMES;	/* Names of quota files */
 
-#ifdef DEBUG_MALLOC
-static size_t malloc_mem = 0;
-static size_t free_mem = 0;
-#endif
+static struct dquot_table dquot_hash[MAXQUOTAS];
+static struct arena dquot_arena;	/* Arena for dquots in dquot_hash */
+static size_t links_mem, links_peak;	/* Current and maximal size of hardlink tables */
+static size_t walk_mem;			/* Memory used by directory tree walkers */
+static struct dlinks_shard links_hash[LINKSHARDS];
+static struct online_shard online_hash[LINKSHARDS];	/* Inodes counted by online check */
 
-static struct dquot *dquot_hash[MAXQUOTAS][DQUOTHASHSIZE];
-static struct dlinks *links_hash[MAXQUOTAS][DQUOTHASHSIZE];
+static struct scan_worker *scan_workers;	/* Workers of parallel scan */
+static long scan_pending;		/* Number of directories queued or being scanned */
+static int scan_failed;			/* Did some worker fail? */
+static pthread_mutex_t scan_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_idle_cond = PTHREAD_COND_INITIALIZER;
 
 /*
  * Ok check each memory allocation.
@@ -85,9 +317,6 @@ void *xmalloc(size_t size)
 {
 	void *ptr;
 
-#ifdef DEBUG_MALLOC
-	malloc_mem += size;
-#endif
 	ptr = malloc(size);
 	if (!ptr)
 		die(3, _("Not enough memory.\n"));
@@ -95,6 +324,53 @@ void *xmalloc(size_t size)
 	return (ptr);
 }
 
+/* Allocate zeroed object from an arena */
+static void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!chunk || chunk->used + size > ARENA_CHUNK_SIZE - sizeof(struct arena_chunk)) {
+		chunk = xmalloc(ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->size += ARENA_CHUNK_SIZE;
+		__atomic_add_fetch(&dquot_mem, ARENA_CHUNK_SIZE, __ATOMIC_RELAXED);
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	return ptr;
+}
+
+/* Move all memory of arena src to arena dst */
+static void arena_splice(struct arena *dst, struct arena *src)
+{
+	struct arena_chunk *chunk;
+
+	if (!src->chunks)
+		return;
+	for (chunk = src->chunks; chunk->next; chunk = chunk->next);
+	chunk->next = dst->chunks;
+	dst->chunks = src->chunks;
+	dst->size += src->size;
+	src->chunks = NULL;
+	src->size = 0;
+}
+
+/* Free all objects allocated from an arena */
+static void arena_free(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+	__atomic_sub_fetch(&dquot_mem, arena->size, __ATOMIC_RELAXED);
+	arena->size = 0;
+}
+
 void debug(int df, char *fmtstr, ...)
 {
 	va_list args;
@@ -109,96 +385,388 @@ void debug(int df, char *fmtstr, ...)
 }
 
 /* Compute hashvalue for given inode number */
-static inline uint hash_ino(uint i_num)
+static inline uint64_t hash_ino(ino_t i_num)
+{
+	return (uint64_t)i_num * 0x9e3779b97f4a7c15ULL;
+}
+
+/* Slot where given inode would be placed in a shard without collisions */
+static inline uint dlinks_home(struct dlinks_shard *shard, ino_t i_num)
+{
+	return (uint)(hash_ino(i_num) >> 16) & (shard->size - 1);
+}
+
+/* Track memory used by hardlink tables */
+static void links_account(ssize_t slots)
+{
+	size_t mem = __atomic_add_fetch(&links_mem, slots * sizeof(struct dlinks), __ATOMIC_RELAXED);
+
+	/* Racy but we need just a rough number */
+	if (mem > links_peak)
+		links_peak = mem;
+}
+
+/* Resize table of a shard and rehash all entries */
+static void dlinks_resize(struct dlinks_shard *shard, uint size)
+{
+	struct dlinks *old = shard->table;
+	uint oldsize = shard->size, i, pos;
+
+	shard->table = xmalloc(sizeof(struct dlinks) * size);
+	shard->size = size;
+	links_account((ssize_t)size - oldsize);
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].i_num)
+			continue;
+		for (pos = dlinks_home(shard, old[i].i_num); shard->table[pos].i_num;
+		     pos = (pos + 1) & (size - 1));
+		shard->table[pos] = old[i];
+	}
+	free(old);
+}
+
+/*
+ * Remove entry from a shard. Following entries of the same cluster are moved
+ * back so that lookups never need to skip deleted entries.
+ */
+static void dlinks_remove(struct dlinks_shard *shard, uint pos)
 {
-	return ((i_num ^ (i_num << 16)) * 997) & (LINKSHASHSIZE - 1);
+	uint mask = shard->size - 1, next = pos, home;
+
+	while (1) {
+		next = (next + 1) & mask;
+		if (!shard->table[next].i_num)
+			break;
+		home = dlinks_home(shard, shard->table[next].i_num);
+		/* Can the entry be moved to the free slot without passing its home? */
+		if (((next - home) & mask) >= ((next - pos) & mask)) {
+			shard->table[pos] = shard->table[next];
+			pos = next;
+		}
+	}
+	shard->table[pos].i_num = 0;
+	shard->used--;
+	if (shard->size > LINKSHARD_MINSIZE && shard->used < shard->size / 8)
+		dlinks_resize(shard, shard->size / 2);
+}
+
+/* Fill free slot pos of the shard with an inode and grow the shard if needed */
+static void dlinks_insert(struct dlinks_shard *shard, uint pos, ino_t i_num, nlink_t seen)
+{
+	shard->table[pos].i_num = i_num;
+	shard->table[pos].seen = seen;
+	if (++shard->used > shard->size / 2)
+		dlinks_resize(shard, shard->size * 2);
+}
+
+/* Add entry for an inode with given number of seen links (when resuming scan) */
+static void restore_dlinks(ino_t i_num, nlink_t seen)
+{
+	struct dlinks_shard *shard = &links_hash[hash_ino(i_num) >> 56];
+	uint pos;
+
+	if (!shard->size) {
+		shard->size = LINKSHARD_MINSIZE;
+		shard->table = xmalloc(sizeof(struct dlinks) * shard->size);
+		links_account(shard->size);
+	}
+	for (pos = dlinks_home(shard, i_num); shard->table[pos].i_num;
+	     pos = (pos + 1) & (shard->size - 1));
+	dlinks_insert(shard, pos, i_num, seen);
 }
 
 /*
  * Store a hardlinked inode as we don't want to count it more then once.
+ * The inode is forgotten once we have seen all its links so we need
+ * to remember only inodes with links in not yet scanned directories.
+ * Returns 1 if the inode has been already counted.
  */
-static int store_dlinks(int type, ino_t i_num)
+static int store_dlinks(ino_t i_num, nlink_t i_nlink)
 {
-	struct dlinks *lptr;
-	uint hash = hash_ino(i_num);
+	struct dlinks_shard *shard = &links_hash[hash_ino(i_num) >> 56];
+	uint pos;
+	int ret = 0;
 
 	debug(FL_DEBUG, _("Adding hardlink for inode %llu\n"), (unsigned long long)i_num);
 
-	for (lptr = links_hash[type][hash]; lptr; lptr = lptr->next)
-		if (lptr->i_num == i_num)
-			return 1;
+	/* Hardlinks can be spread over subtrees scanned by different workers */
+	if (scan_threads > 1)
+		pthread_mutex_lock(&shard->lock);
+	if (!shard->size) {
+		shard->size = LINKSHARD_MINSIZE;
+		shard->table = xmalloc(sizeof(struct dlinks) * shard->size);
+		links_account(shard->size);
+	}
+	for (pos = dlinks_home(shard, i_num); shard->table[pos].i_num;
+	     pos = (pos + 1) & (shard->size - 1)) {
+		if (shard->table[pos].i_num == i_num) {
+			if (++shard->table[pos].seen >= i_nlink)
+				dlinks_remove(shard, pos);
+			ret = 1;
+			goto out;
+		}
+	}
+	dlinks_insert(shard, pos, i_num, 1);
+out:
+	if (scan_threads > 1)
+		pthread_mutex_unlock(&shard->lock);
+	return ret;
+}
+
+/*
+ * During online check we remember every counted inode together with its
+ * ids and space so that we can fix usage when the inode changes after it
+ * has been counted. The table also makes sure no inode is counted twice (it
+ * can be seen twice when it is hardlinked or moved during the scan).
+ */
 
-	lptr = (struct dlinks *)xmalloc(sizeof(struct dlinks));
+static inline uint online_home(struct online_shard *shard, ino_t i_num)
+{
+	return (uint)(hash_ino(i_num) >> 16) & (shard->size - 1);
+}
 
-	lptr->i_num = i_num;
-	lptr->next = links_hash[type][hash];
-	links_hash[type][hash] = lptr;
-	return 0;
+static void online_resize(struct online_shard *shard, uint size)
+{
+	struct online_inode *old = shard->table;
+	uint oldsize = shard->size, i, pos;
+
+	shard->table = xmalloc(sizeof(struct online_inode) * size);
+	shard->size = size;
+	__atomic_add_fetch(&links_mem, ((ssize_t)size - oldsize) * sizeof(struct online_inode),
+			   __ATOMIC_RELAXED);
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].i_num)
+			continue;
+		for (pos = online_home(shard, old[i].i_num); shard->table[pos].i_num;
+		     pos = (pos + 1) & (size - 1));
+		shard->table[pos] = old[i];
+	}
+	free(old);
+	if (links_mem > links_peak)
+		links_peak = links_mem;
+}
+
+/* Remember counted inode. Returns 1 if the inode has been already counted. */
+static int online_record(ino_t i_num, uid_t uid, gid_t gid, qid_t prjid, loff_t space)
+{
+	struct online_shard *shard = &online_hash[hash_ino(i_num) >> 56];
+	struct online_inode *oi;
+	uint pos;
+	int ret = 0;
+
+	if (scan_threads > 1)
+		pthread_mutex_lock(&shard->lock);
+	if (!shard->size)
+		online_resize(shard, LINKSHARD_MINSIZE);
+	for (pos = online_home(shard, i_num); shard->table[pos].i_num;
+	     pos = (pos + 1) & (shard->size - 1)) {
+		if (shard->table[pos].i_num == i_num) {
+			ret = 1;
+			goto out;
+		}
+	}
+	oi = &shard->table[pos];
+	oi->i_num = i_num;
+	oi->uid = uid;
+	oi->gid = gid;
+	oi->prjid = prjid;
+	oi->space = space;
+	if (++shard->used > shard->size / 2)
+		online_resize(shard, shard->size * 2);
+out:
+	if (scan_threads > 1)
+		pthread_mutex_unlock(&shard->lock);
+	return ret;
 }
 
-/* Hash given id */
-static inline uint hash_dquot(uint id)
+/* Find counted inode (must not run in parallel with the scan) */
+static struct online_inode *online_find(ino_t i_num)
 {
-	return ((id ^ (id << 16)) * 997) & (DQUOTHASHSIZE - 1);
+	struct online_shard *shard = &online_hash[hash_ino(i_num) >> 56];
+	uint pos;
+
+	if (!shard->size)
+		return NULL;
+	for (pos = online_home(shard, i_num); shard->table[pos].i_num;
+	     pos = (pos + 1) & (shard->size - 1))
+		if (shard->table[pos].i_num == i_num)
+			return &shard->table[pos];
+	return NULL;
 }
 
 /*
- * Do a lookup of a type of quota for a specific id. Use short cut with
- * most recently used dquot struct pointer.
+ * Hash given id. Ids are often allocated from dense ranges so mix all the
+ * bits (this is the finalizer of MurmurHash3).
  */
-struct dquot *lookup_dquot(qid_t id, int type)
+static inline uint hash_dquot(const struct dquot_table *table, uint id)
+{
+	id ^= id >> 16;
+	id *= 0x85ebca6b;
+	id ^= id >> 13;
+	id *= 0xc2b2ae35;
+	id ^= id >> 16;
+	return id & (table->size - 1);
+}
+
+/* Find dquot for given id in given hashtable */
+static struct dquot *find_dquot(const struct dquot_table *table, qid_t id)
 {
 	struct dquot *lptr;
-	uint hash = hash_dquot(id);
 
-	for (lptr = dquot_hash[type][hash]; lptr != NODQUOT; lptr = lptr->dq_next)
+	if (!table->size)
+		return NODQUOT;
+	for (lptr = table->hash[hash_dquot(table, id)]; lptr != NODQUOT; lptr = lptr->dq_next)
 		if (lptr->dq_id == id)
 			return lptr;
 	return NODQUOT;
 }
 
-/*
- * Add a new dquot for a new id to the list.
- */
-struct dquot *add_dquot(qid_t id, int type)
+/* Link dquot into a hashtable, grow the table when chains get long */
+static void link_dquot(struct dquot_table *table, struct dquot *dquot)
+{
+	uint hashval;
+
+	if (table->count >= table->size) {
+		struct dquot **oldhash = table->hash;
+		struct dquot *lptr;
+		uint oldsize = table->size, i;
+
+		table->size = oldsize ? oldsize * 2 : DQUOTHASH_MINSIZE;
+		table->hash = xmalloc(sizeof(struct dquot *) * table->size);
+		__atomic_add_fetch(&dquot_mem, sizeof(struct dquot *) * (table->size - oldsize),
+				   __ATOMIC_RELAXED);
+		for (i = 0; i < oldsize; i++) {
+			while ((lptr = oldhash[i]) != NODQUOT) {
+				oldhash[i] = lptr->dq_next;
+				hashval = hash_dquot(table, lptr->dq_id);
+				lptr->dq_next = table->hash[hashval];
+				table->hash[hashval] = lptr;
+			}
+		}
+		free(oldhash);
+	}
+	hashval = hash_dquot(table, dquot->dq_id);
+	dquot->dq_next = table->hash[hashval];
+	table->hash[hashval] = dquot;
+	table->count++;
+}
+
+/* Free hash chains of a table. Dquots themselves live in arenas. */
+static void free_dquot_table(struct dquot_table *table)
+{
+	free(table->hash);
+	__atomic_sub_fetch(&dquot_mem, sizeof(struct dquot *) * table->size, __ATOMIC_RELAXED);
+	table->hash = NULL;
+	table->size = table->count = 0;
+}
+
+/* Add a new dquot for given id to given hashtable */
+static struct dquot *insert_dquot(struct dquot_table *table, struct arena *arena, qid_t id, int type)
 {
 	struct dquot *lptr;
-	uint hash = hash_dquot(id);
 
 	debug(FL_DEBUG, _("Adding dquot structure type %s for %d\n"), type2name(type), (int)id);
 
-	lptr = (struct dquot *)xmalloc(sizeof(struct dquot));
+	lptr = (struct dquot *)arena_alloc(arena, sizeof(struct dquot));
 
 	lptr->dq_id = id;
-	lptr->dq_next = dquot_hash[type][hash];
-	dquot_hash[type][hash] = lptr;
 	lptr->dq_dqb.dqb_btime = lptr->dq_dqb.dqb_itime = (time_t) 0;
+	link_dquot(table, lptr);
 
 	return lptr;
 }
 
 /*
- * Add a number of blocks and inodes to a quota.
+ * Do a lookup of a type of quota for a specific id.
+ */
+struct dquot *lookup_dquot(qid_t id, int type)
+{
+	return find_dquot(&dquot_hash[type], id);
+}
+
+/*
+ * Add a new dquot for a new id to the list.
+ */
+struct dquot *add_dquot(qid_t id, int type)
+{
+	return insert_dquot(&dquot_hash[type], &dquot_arena, id, type);
+}
+
+/*
+ * Move usage gathered in given hashtables (by a worker or from a checkpoint)
+ * to the main hashtables. Arena holding the dquots has to be moved to the main
+ * one as well.
+ */
+static void merge_dquots(struct dquot_table *hash)
+{
+	int type;
+	uint i;
+	struct dquot *dquot, *target;
+
+	for (type = 0; type < MAXQUOTAS; type++) {
+		for (i = 0; i < hash[type].size; i++) {
+			while ((dquot = hash[type].hash[i]) != NODQUOT) {
+				hash[type].hash[i] = dquot->dq_next;
+				target = lookup_dquot(dquot->dq_id, type);
+				if (target != NODQUOT) {
+					target->dq_dqb.dqb_curinodes += dquot->dq_dqb.dqb_curinodes;
+					target->dq_dqb.dqb_curspace += dquot->dq_dqb.dqb_curspace;
+				}
+				else {
+					link_dquot(&dquot_hash[type], dquot);
+				}
+			}
+		}
+		free_dquot_table(&hash[type]);
+	}
+}
+
+/*
+ * Add a number of blocks and inodes to all checked quotas of an inode. Usage
+ * is gathered in given hashtables (the main ones or the ones of a scanning
+ * thread).
  */
-static void add_to_quota(int type, ino_t i_num, uid_t i_uid, gid_t i_gid, mode_t i_mode,
+static void add_to_quota(struct dquot_table *hash, struct arena *arena,
+			 ino_t i_num, uid_t i_uid, gid_t i_gid, qid_t i_prjid, mode_t i_mode,
 			 nlink_t i_nlink, loff_t i_space, int need_remember)
 {
-	qid_t wanted;
+	qid_t wanted[MAXQUOTAS] = { i_uid, i_gid, i_prjid };
+	int check[MAXQUOTAS] = { ucheck, gcheck, pcheck };
 	struct dquot *lptr;
+	int type;
 
-	if (type == USRQUOTA)
-		wanted = i_uid;
-	else
-		wanted = i_gid;
+	if (flags & FL_ONLINE) {
+		if (online_record(i_num, i_uid, i_gid, i_prjid, i_space))
+			return;
+	}
+	else if (i_nlink != 1 && need_remember)
+		if (store_dlinks(i_num, i_nlink))	/* Did we already count this inode? */
+			return;
+	if (progress.fd >= 0) {
+		__atomic_add_fetch(&progress.inodes, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&progress.bytes, i_space, __ATOMIC_RELAXED);
+	}
+	for (type = 0; type < MAXQUOTAS; type++) {
+		if (!check[type])
+			continue;
+		if ((lptr = find_dquot(&hash[type], wanted[type])) == NODQUOT)
+			lptr = insert_dquot(&hash[type], arena, wanted[type], type);
+		lptr->dq_dqb.dqb_curinodes++;
+		lptr->dq_dqb.dqb_curspace += i_space;
+	}
+}
 
-	if ((lptr = lookup_dquot(wanted, type)) == NODQUOT)
-		lptr = add_dquot(wanted, type);
+/* Forget all remembered hardlinks */
+static void free_dlinks(void)
+{
+	uint i;
 
-	if (i_nlink != 1 && need_remember)
-		if (store_dlinks(type, i_num))	/* Did we already count this inode? */
-			return;
-	lptr->dq_dqb.dqb_curinodes++;
-	lptr->dq_dqb.dqb_curspace += i_space;;
+	for (i = 0; i < LINKSHARDS; i++) {
+		links_account(-(ssize_t)links_hash[i].size);
+		free(links_hash[i].table);
+		links_hash[i].table = NULL;
+		links_hash[i].size = links_hash[i].used = 0;
+	}
 }
 
 /*
@@ -206,51 +774,77 @@ static void add_to_quota(int type, ino_t i_num, uid_t i_uid, gid_t i_gid, mode_t
  */
 static void remove_list(void)
 {
-	int cnt;
 	uint i;
-	struct dquot *dquot, *dquot_free;
-	struct dlinks *dlink, *dlink_free;
-
-	for (cnt = 0; cnt < MAXQUOTAS; cnt++) {
-		for (i = 0; i < DQUOTHASHSIZE; i++) {
-			dquot = dquot_hash[cnt][i];
-			while (dquot != NODQUOT) {
-				dquot_free = dquot;
-				dquot = dquot->dq_next;
-#ifdef DEBUG_MALLOC
-				free_mem += sizeof(struct dquot);
-#endif
-				free(dquot_free);
-			}
-			dquot_hash[cnt][i] = NODQUOT;
-		}
-		for (i = 0; i < LINKSHASHSIZE; i++) {
-			dlink = links_hash[cnt][i];
-			while (dlink) {
-				dlink_free = dlink;
-				dlink = dlink->next;
-#ifdef DEBUG_MALLOC
-				free_mem += sizeof(struct dlinks);
-#endif
-				free(dlink_free);
-			}
-			links_hash[cnt][i] = NULL;
+
+	for (i = 0; i < MAXQUOTAS; i++)
+		free_dquot_table(&dquot_hash[i]);
+	arena_free(&dquot_arena);
+	free_dlinks();
+	for (i = 0; i < LINKSHARDS; i++) {
+		free(online_hash[i].table);
+		online_hash[i].table = NULL;
+		online_hash[i].size = online_hash[i].used = 0;
+	}
+	links_mem = links_peak = walk_mem = 0;
+}
+
+/*
+ * Get information about a file (fname is relative to directory dirfd). We use
+ * statx() when available and ask only for the fields we need so that the
+ * filesystem doesn't have to compute (or fetch from a server) the rest.
+ */
+static int stat_entry(int dirfd, const char *fname, struct stat *st)
+{
+#ifdef HAVE_STATX
+	static int statx_unsupported;
+	struct statx stx;
+
+	if (!statx_unsupported) {
+		if (statx(dirfd, fname, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+			  STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID |
+			  STATX_GID | STATX_INO | STATX_SIZE | STATX_BLOCKS, &stx) == 0) {
+			memset(st, 0, sizeof(*st));
+			st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+			st->st_ino = stx.stx_ino;
+			st->st_mode = stx.stx_mode;
+			st->st_nlink = stx.stx_nlink;
+			st->st_uid = stx.stx_uid;
+			st->st_gid = stx.stx_gid;
+			st->st_size = stx.stx_size;
+			st->st_blocks = stx.stx_blocks;
+			return 0;
 		}
+		if (errno != ENOSYS)
+			return -1;
+		statx_unsupported = 1;
 	}
+#endif
+	return fstatat(dirfd, fname, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * Does the filesystem account space not rounded to 512 bytes so that
+ * st_blocks doesn't exactly match what quota accounts?
+ */
+static int fs_needs_qsize_ioctl(const char *fstype)
+{
+	return !strcmp(fstype, MNTTYPE_REISER);
 }
 
-/* Get size used by file */
-static loff_t getqsize(const char *fname, struct stat *st)
+/* Get size used by file (fname is relative to directory dirfd) */
+static loff_t getqsize(int dirfd, const char *fname, struct stat *st)
 {
 	static char ioctl_fail_warn;
 	int fd;
 	loff_t size;
 
+	if (!qsize_ioctl)
+		return st->st_blocks << 9;
 	if (S_ISLNK(st->st_mode))	/* There's no way to do ioctl() on links... */
 		return st->st_blocks << 9;
 	if (!S_ISDIR(st->st_mode) && !S_ISREG(st->st_mode))
 		return st->st_blocks << 9;
-	if ((fd = open(fname, O_RDONLY)) == -1)
+	if ((fd = openat(dirfd, fname, O_RDONLY)) == -1)
 		die(2, _("Cannot open file %s: %s\n"), fname, strerror(errno));
 	if (ioctl(fd, FIOQSIZE, &size) == -1) {
 		size = st->st_blocks << 9;
@@ -263,6 +857,196 @@ static loff_t getqsize(const char *fname, struct stat *st)
 	return size;
 }
 
+/* During online check entries can disappear under us, changes will be fixed later */
+static int entry_vanished(int err)
+{
+	return flags & FL_ONLINE && (err == ENOENT || err == ENOTDIR || err == ELOOP || err == ESTALE);
+}
+
+/* Get project ID of an open file and whether new inodes in it inherit it */
+static int get_fd_projid(int fd, const char *fname, qid_t *projid, int *projinherit)
+{
+	struct fsxattr fsx;
+
+	if (ioctl(fd, FS_IOC_FSGETXATTR, &fsx) < 0) {
+		errstr(_("Cannot get project ID of %s: %s\n"), fname, strerror(errno));
+		return -1;
+	}
+	*projid = fsx.fsx_projid;
+	if (projinherit)
+		*projinherit = !!(fsx.fsx_xflags & FS_XFLAG_PROJINHERIT);
+	return 0;
+}
+
+/*
+ * Get project ID of a file (fname is relative to directory dirfd). Only
+ * regular files and directories can be safely opened for the ioctl. Other
+ * inodes got project ID of the directory they are in when they were created
+ * in a directory with project inheritance and project 0 otherwise.
+ */
+static int get_projid(int dirfd, const char *fname, struct stat *st, qid_t dir_projid,
+		      int dir_projinherit, qid_t *projid)
+{
+	int fd, ret;
+
+	*projid = dir_projinherit ? dir_projid : 0;
+	if (!pcheck || (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)))
+		return 0;
+	if ((fd = openat(dirfd, fname, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY)) < 0) {
+		if (entry_vanished(errno))
+			return 0;
+		errstr(_("Cannot open file %s: %s\n"), fname, strerror(errno));
+		return -1;
+	}
+	ret = get_fd_projid(fd, fname, projid, NULL);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Progress reporting. Reports are JSON objects, one per line, written
+ * periodically and whenever a phase of the check ends so that the caller
+ * can estimate time to completion.
+ */
+
+static double progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Copy string to buffer escaping it for JSON */
+static void json_escape(char *buf, size_t size, const char *str)
+{
+	size_t len = 0;
+
+	for (; *str && len + 7 < size; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = c;
+		}
+		else if (c < 0x20) {
+			len += sprintf(buf + len, "\\u%04x", c);
+		}
+		else {
+			buf[len++] = c;
+		}
+	}
+	buf[len] = 0;
+}
+
+/* Write one progress report. Called with progress.lock held. */
+static void progress_report(const char *event, int failed)
+{
+	char dir[PATH_MAX * 2], buf[PATH_MAX * 2 + 1024];
+	double now = progress_now(), rate = 0;
+	uint64_t inodes = __atomic_load_n(&progress.inodes, __ATOMIC_RELAXED);
+	long queued = __atomic_load_n(&progress.queued, __ATOMIC_RELAXED);
+	size_t len;
+	int i;
+
+	if (now > progress.last_time)
+		rate = (inodes - progress.last_inodes) / (now - progress.last_time);
+	progress.last_time = now;
+	progress.last_inodes = inodes;
+	json_escape(dir, sizeof(dir), progress.dir);
+	len = snprintf(buf, sizeof(buf),
+		"{\"event\":\"%s\",\"filesystem\":\"%s\",\"phase\":\"%s\",\"elapsed\":%.3f,"
+		"\"inodes\":%llu,\"inodes_per_sec\":%.1f,\"dirs_queued\":%ld,\"bytes\":%llu,"
+		"\"dquot_memory\":%zu,\"hardlink_memory\":%zu,\"phase_times\":{",
+		event, dir, phase_names[progress.phase], now - progress.start,
+		(unsigned long long)inodes, rate, queued > 0 ? queued : 0,
+		(unsigned long long)__atomic_load_n(&progress.bytes, __ATOMIC_RELAXED),
+		__atomic_load_n(&dquot_mem, __ATOMIC_RELAXED),
+		__atomic_load_n(&links_mem, __ATOMIC_RELAXED));
+	for (i = 0; i < PHASE_COUNT; i++) {
+		double t = progress.phase_times[i];
+
+		if (i == progress.phase && !progress.stop)
+			t += now - progress.phase_start;
+		len += snprintf(buf + len, sizeof(buf) - len, "%s\"%s\":%.3f", i ? "," : "",
+				phase_names[i], t);
+	}
+	if (failed >= 0)
+		len += snprintf(buf + len, sizeof(buf) - len, "},\"failed\":%s}\n",
+				failed ? "true" : "false");
+	else
+		len += snprintf(buf + len, sizeof(buf) - len, "}}\n");
+	if (write(progress.fd, buf, len) < 0) {
+		/* Nobody listens anymore? Don't bother. */
+	}
+}
+
+/* Thread reporting progress of the check periodically */
+static void *progress_thread(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&progress.lock);
+	while (!progress.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += PROGRESS_INTERVAL;
+		pthread_cond_timedwait(&progress.cond, &progress.lock, &ts);
+		if (!progress.stop)
+			progress_report("progress", -1);
+	}
+	pthread_mutex_unlock(&progress.lock);
+	return NULL;
+}
+
+/* Start reporting progress of a check of the filesystem mounted at dir */
+static void progress_start(const char *dir)
+{
+	int ret;
+
+	if (progress.fd < 0)
+		return;
+	progress.dir = dir;
+	progress.phase = PHASE_LOAD;
+	progress.start = progress.phase_start = progress.last_time = progress_now();
+	memset(progress.phase_times, 0, sizeof(progress.phase_times));
+	progress.inodes = progress.bytes = progress.last_inodes = 0;
+	progress.queued = 0;
+	progress.stop = 0;
+	ret = pthread_create(&progress.thread, NULL, progress_thread, NULL);
+	if (ret)
+		die(2, _("Cannot create progress reporting thread: %s\n"), strerror(ret));
+}
+
+/* Finish current phase of the check and start given one */
+static void progress_phase(int phase)
+{
+	double now;
+
+	if (progress.fd < 0 || phase == progress.phase)
+		return;
+	pthread_mutex_lock(&progress.lock);
+	now = progress_now();
+	progress.phase_times[progress.phase] += now - progress.phase_start;
+	progress.phase = phase;
+	progress.phase_start = now;
+	progress_report("phase", -1);
+	pthread_mutex_unlock(&progress.lock);
+}
+
+/* Stop reporting progress and write final report */
+static void progress_stop(int failed)
+{
+	if (progress.fd < 0)
+		return;
+	pthread_mutex_lock(&progress.lock);
+	progress.phase_times[progress.phase] += progress_now() - progress.phase_start;
+	progress.stop = 1;
+	pthread_cond_signal(&progress.cond);
+	pthread_mutex_unlock(&progress.lock);
+	pthread_join(progress.thread, NULL);
+	progress_report("done", failed ? 1 : 0);
+}
+
 /*
  * Show a blitting cursor as means of visual progress indicator.
  */
@@ -272,6 +1056,9 @@ static inline void blit(const char *msg)
 	static const char bits[] = "|/-\\";
 	static int slow_down;
 
+	/* Output of parallel checks is captured, cursor would just be garbage there */
+	if (check_jobs > 1)
+		return;
 	if (flags & FL_VERYVERBOSE && msg) {
 		int len = strlen(msg);
 		
@@ -294,9 +1081,10 @@ static inline void blit(const char *msg)
 
 static void usage(void)
 {
-	printf(_("Utility for checking and repairing quota files.\n%s [-gucbfinvdmMR] [-F <quota-format>] filesystem|-a\n\n\
+	printf(_("Utility for checking and repairing quota files.\n%s [-gucPbfinvdmMRs] [-F <quota-format>] [-t <threads>] [-j <jobs>] [-S <dir> [-o <file>|-r <file>]] [-C <file> [--resume]] [--in-place] [--online] filesystem|-a\n\n\
 -u, --user                check user files\n\
 -g, --group               check group files\n\
+-P, --project             check project quotas\n\
 -c, --create-files        create new quota files\n\
 -b, --backup              create backups of old quota files\n\
 -f, --force               force check even if quotas are enabled\n\
@@ -309,6 +1097,19 @@ static void usage(void)
                           continue even if it fails\n\
 -R, --exclude-root        exclude root when checking all filesystems\n\
 -F, --format=formatname   check quota files of specific format\n\
+-t, --threads=num         scan filesystem with given number of threads\n\
+-j, --jobs=num            check given number of devices in parallel with -a\n\
+-S, --subtree=dir         recount just given directory tree and fix usage\n\
+-o, --save-usage=file     save usage of the directory tree to file\n\
+-C, --checkpoint=file     periodically save progress of the scan to file\n\
+    --checkpoint-interval=secs  save progress every secs seconds\n\
+    --resume              continue the scan from checkpoint\n\
+    --progress=json       report progress as JSON objects\n\
+    --progress-fd=fd      report progress to given file descriptor\n\
+    --in-place            update changed entries in existing quota files\n\
+    --online              check without remounting, track changes during scan\n\
+-r, --replaced=file       usage of what the directory tree replaced\n\
+-s, --sort-inodes         stat directory entries in order of inode numbers\n\
 -a, --all                 check all filesystems\n\
 -h, --help                display this message and exit\n\
 -V, --version             display version information and exit\n\n"), progname);
@@ -319,6 +1120,7 @@ static void usage(void)
 static void parse_options(int argcnt, char **argstr)
 {
 	int ret;
+	char *errch;
 	struct option long_opts[] = {
 		{ "version", 0, NULL, 'V' },
 		{ "help", 0, NULL, 'h' },
@@ -328,10 +1130,24 @@ static void parse_options(int argcnt, char **argstr)
 		{ "debug", 0, NULL, 'd' },
 		{ "user", 0, NULL, 'u' },
 		{ "group", 0, NULL, 'g' },
+		{ "project", 0, NULL, 'P' },
 		{ "interactive", 0, NULL, 'i' },
 		{ "use-first-dquot", 0, NULL, 'n' },
 		{ "force", 0, NULL, 'f' },
 		{ "format", 1, NULL, 'F' },
+		{ "threads", 1, NULL, 't' },
+		{ "jobs", 1, NULL, 'j' },
+		{ "subtree", 1, NULL, 'S' },
+		{ "save-usage", 1, NULL, 'o' },
+		{ "replaced", 1, NULL, 'r' },
+		{ "checkpoint", 1, NULL, 'C' },
+		{ "resume", 0, NULL, 256 },
+		{ "checkpoint-interval", 1, NULL, 257 },
+		{ "progress", 1, NULL, 258 },
+		{ "progress-fd", 1, NULL, 259 },
+		{ "in-place", 0, NULL, 260 },
+		{ "online", 0, NULL, 261 },
+		{ "sort-inodes", 0, NULL, 's' },
 		{ "no-remount", 0, NULL, 'm' },
 		{ "try-remount", 0, NULL, 'M' },
 		{ "exclude-root", 0, NULL, 'R' },
@@ -339,7 +1155,7 @@ static void parse_options(int argcnt, char **argstr)
 		{ NULL, 0, NULL, 0 }
 	};
 
-	while ((ret = getopt_long(argcnt, argstr, "VhbcvugidnfF:mMRa", long_opts, NULL)) != -1) {
+	while ((ret = getopt_long(argcnt, argstr, "VhbcvugPidnfF:t:j:S:o:r:C:smMRa", long_opts, NULL)) != -1) {
   	        switch (ret) {
 		  case 'b':
   		          flags |= FL_BACKUPS;
@@ -350,6 +1166,9 @@ static void parse_options(int argcnt, char **argstr)
 		  case 'u':
 			  uwant = 1;
 			  break;
+		  case 'P':
+			  pwant = 1;
+			  break;
 		  case 'd':
 			  flags |= FL_DEBUG;
 			  setlinebuf(stderr);
@@ -391,11 +1210,76 @@ static void parse_options(int argcnt, char **argstr)
 			  if ((fmt = name2fmt(optarg)) == QF_ERROR)
 				  exit(1);
 			  break;
-		  default:
+		  case 's':
+			  flags |= FL_SORTINODES;
+			  break;
+		  case 't':
+			  scan_threads = strtol(optarg, &errch, 10);
+			  if (*errch || scan_threads < 1 || scan_threads > MAXSCANTHREADS) {
+				  errstr(_("Bad number of threads: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 'S':
+			  subtree = optarg;
+			  break;
+		  case 'o':
+			  save_usage_file = optarg;
+			  break;
+		  case 'r':
+			  replaced_file = optarg;
+			  break;
+		  case 'C':
+			  checkpoint_file = optarg;
+			  break;
+		  case 256:
+			  resume = 1;
+			  break;
+		  case 257:
+			  checkpoint_interval = strtol(optarg, &errch, 10);
+			  if (*errch || checkpoint_interval < 1) {
+				  errstr(_("Bad checkpoint interval: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 258:
+			  if (strcmp(optarg, "json")) {
+				  errstr(_("Unknown progress format: %s\n"), optarg);
+				  usage();
+			  }
+			  if (progress.fd < 0)
+				  progress.fd = STDERR_FILENO;
+			  break;
+		  case 259:
+			  progress.fd = strtol(optarg, &errch, 10);
+			  if (*errch || progress.fd < 0 || fcntl(progress.fd, F_GETFD) < 0) {
+				  errstr(_("Bad progress file descriptor: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  case 260:
+			  flags |= FL_INPLACE;
+			  break;
+		  case 261:
+#ifdef HAVE_FANOTIFY
+			  flags |= FL_ONLINE | FL_NOREMOUNT;
+#else
+			  errstr(_("Online check is not supported.\n"));
+			  usage();
+#endif
+			  break;
+		  case 'j':
+			  check_jobs = strtol(optarg, &errch, 10);
+			  if (*errch || check_jobs < 1 || check_jobs > MAXCHECKJOBS) {
+				  errstr(_("Bad number of jobs: %s\n"), optarg);
+				  usage();
+			  }
+			  break;
+		  default:
 			usage();
 		}
 	}
-	if (!(uwant | gwant))
+	if (!(uwant | gwant | pwant))
 		uwant = 1;
 	if ((argcnt == optind && !(flags & FL_ALL)) || (argcnt > optind && flags & FL_ALL)) {
 		fputs(_("Bad number of arguments.\n"), stderr);
@@ -403,206 +1287,1085 @@ static void parse_options(int argcnt, char **argstr)
 	}
 	if (flags & FL_VERBOSE && flags & FL_DEBUG)
 		flags &= ~FL_VERBOSE;
+	if (!(flags & FL_ALL))
+		check_jobs = 1;
+	if ((save_usage_file || replaced_file) && !subtree) {
+		fputs(_("Saved usage can be used only when checking a directory tree.\n"), stderr);
+		usage();
+	}
+	if (subtree && (flags & FL_ALL || (save_usage_file && replaced_file))) {
+		fputs(_("Directory tree can be checked only on one filesystem and usage can be either saved or applied.\n"), stderr);
+		usage();
+	}
+	if (resume && !checkpoint_file) {
+		fputs(_("Checkpoint file has to be specified to resume a scan.\n"), stderr);
+		usage();
+	}
+	if (checkpoint_file && (flags & FL_ALL || subtree || scan_threads > 1)) {
+		fputs(_("Checkpoints can be used only for a scan of one filesystem with one thread.\n"), stderr);
+		usage();
+	}
+	if (flags & FL_ONLINE && (checkpoint_file || subtree)) {
+		fputs(_("Online check cannot be combined with checkpoints or checking a directory tree.\n"), stderr);
+		usage();
+	}
+	if (flags & FL_INPLACE && flags & (FL_NEWFILE | FL_BACKUPS)) {
+		fputs(_("Quota files cannot be updated in place when creating new ones or backups.\n"), stderr);
+		usage();
+	}
+	if (check_jobs > 1 && flags & FL_INTERACTIVE) {
+		fputs(_("Interactive mode cannot be used when checking devices in parallel.\n"), stderr);
+		usage();
+	}
 	if (!(flags & FL_ALL))
 		mntpoint = argstr[optind];
 	else
 		mntpoint = NULL;
 }
 
+/*
+ * Directory tree walker. The walker keeps a stack of directories being
+ * scanned and looks up everything relative to their descriptors so it
+ * never needs chdir() or full paths. Names of subdirectories waiting for
+ * scan are kept in an arena (each name prefixed by the inode number of the
+ * directory). To bound the number of open descriptors, only MAXOPENDIRS
+ * topmost directories on the stack are kept open and the others are reopened
+ * through ".." when the walker returns to them.
+ *
+ * For parallel scan each thread has its own walker. A thread without work
+ * steals a directory waiting for scan from the bottom of the stack of another
+ * walker (these tend to be the largest unscanned subtrees). Usage is gathered
+ * in per-walker hashtables which are merged into the main ones once the scan
+ * is finished.
+ */
+
+/* Lock walker against thieves */
+static inline void walker_lock(struct scan_walker *w)
+{
+	if (scan_threads > 1)
+		pthread_mutex_lock(&w->lock);
+}
+
+static inline void walker_unlock(struct scan_walker *w)
+{
+	if (scan_threads > 1)
+		pthread_mutex_unlock(&w->lock);
+}
+
+/* Get name stored at given offset of names arena */
+static inline char *walker_name(struct scan_walker *w, size_t off)
+{
+	return w->names + off + sizeof(ino_t);
+}
+
+/* Get offset of a name following the one at given offset */
+static inline size_t walker_next_name(struct scan_walker *w, size_t off)
+{
+	return off + sizeof(ino_t) + strlen(walker_name(w, off)) + 1;
+}
+
+/*
+ * Build path of the directory at given depth of walker stack (with name
+ * appended if not NULL). The path is used only for messages so we build it
+ * just when needed. Returned string has to be freed.
+ */
+static char *walker_path(struct scan_walker *w, int depth, const char *name)
+{
+	size_t len = 0;
+	char *path, *comp;
+	int i;
+
+	for (i = 0; i < depth; i++)
+		len += strlen(walker_name(w, w->frames[i].name)) + 1;
+	if (name)
+		len += strlen(name) + 1;
+	path = xmalloc(len + 1);
+	for (i = 0; i < depth; i++) {
+		comp = walker_name(w, w->frames[i].name);
+		if (i)
+			strcat(path, "/");
+		strcat(path, comp);
+	}
+	if (name) {
+		if (depth)
+			strcat(path, "/");
+		strcat(path, name);
+	}
+	return path;
+}
+
+/* Remember subdirectory to scan later */
+static void walker_add_name(struct scan_walker *w, ino_t ino, const char *name)
+{
+	size_t len = sizeof(ino_t) + strlen(name) + 1;
+
+	if (w->names_len + len > w->names_size) {
+		walker_lock(w);
+		w->names_size = (w->names_len + len) * 2;
+		w->names = srealloc(w->names, w->names_size);
+		walker_unlock(w);
+	}
+	memcpy(w->names + w->names_len, &ino, sizeof(ino_t));
+	strcpy(w->names + w->names_len + sizeof(ino_t), name);
+	w->names_len += len;
+}
+
+/* Push open directory on walker stack */
+static int walker_push(struct scan_walker *w, int fd, size_t name)
+{
+	struct scan_frame *frame;
+	qid_t projid = 0;
+	int projinherit = 0;
+	char *path;
+
+	if (pcheck && get_fd_projid(fd, walker_name(w, name), &projid, &projinherit) < 0) {
+		path = walker_path(w, w->depth, walker_name(w, name));
+		errstr(_("Cannot get project of directory %s\n"), path);
+		free(path);
+		close(fd);
+		return -1;
+	}
+
+	walker_lock(w);
+	if (w->depth == w->frames_size) {
+		w->frames_size = w->frames_size ? w->frames_size * 2 : 16;
+		w->frames = srealloc(w->frames, sizeof(struct scan_frame) * w->frames_size);
+	}
+	frame = &w->frames[w->depth++];
+	frame->fd = fd;
+	frame->name = name;
+	frame->start = frame->next = frame->end = w->names_len;
+	frame->projid = projid;
+	frame->projinherit = projinherit;
+	walker_unlock(w);
+	/* Too many directories open? Close the lowest one. */
+	if (w->depth - w->closed > max_open_dirs) {
+		close(w->frames[w->closed].fd);
+		w->frames[w->closed++].fd = -1;
+	}
+	return 0;
+}
+
+/* Return from the top directory on the stack to its parent */
+static int walker_pop(struct scan_walker *w)
+{
+	struct scan_frame *frame = &w->frames[w->depth - 1];
+	struct scan_frame *parent = frame - 1;
+	struct stat st;
+	ino_t ino;
+	char *path;
+	int fd = -1;
+
+	if (flags & FL_DEBUG) {
+		path = walker_path(w, w->depth, NULL);
+		debug(FL_DEBUG, _("Leaving %s\n"), path);
+		free(path);
+	}
+	if (w->depth > 1 && parent->fd == -1) {
+		/* Parent has been closed to save descriptors, reopen it */
+		memcpy(&ino, w->names + parent->name, sizeof(ino_t));
+		fd = openat(frame->fd, "..", O_RDONLY | O_DIRECTORY);
+		if (fd < 0 || fstat(fd, &st) < 0 || st.st_ino != ino) {
+			path = walker_path(w, w->depth - 1, NULL);
+			errstr(_("Cannot return to directory %s. Was it moved?\n"), path);
+			free(path);
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		parent->fd = fd;
+		w->closed--;
+	}
+	close(frame->fd);
+	walker_lock(w);
+	w->depth--;
+	w->names_len = frame->start;
+	walker_unlock(w);
+	return 0;
+}
+
+/* Close all directories on walker stack */
+static void walker_reset(struct scan_walker *w)
+{
+	int i;
+
+	for (i = 0; i < w->depth; i++)
+		if (w->frames[i].fd >= 0)
+			close(w->frames[i].fd);
+	walker_lock(w);
+	w->depth = w->closed = 0;
+	w->names_len = 0;
+	walker_unlock(w);
+}
+
+/* Directory has been read */
+static void finish_dir(void)
+{
+	if (scan_threads == 1)
+		return;
+	if (!__atomic_sub_fetch(&scan_pending, 1, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&scan_idle_lock);
+		pthread_cond_broadcast(&scan_idle_cond);
+		pthread_mutex_unlock(&scan_idle_lock);
+	}
+}
+
+/*
+ * Stat an entry of the directory on top of walker stack and add its size to
+ * the appropriate quotas. Subdirectories are remembered for later scan.
+ * Returns 1 for subdirectory, 0 for other entries, -1 on error.
+ */
+static int walker_stat_entry(struct scan_walker *w, const char *name)
+{
+	struct scan_frame *frame = &w->frames[w->depth - 1];
+	struct stat st;
+	loff_t qspace;
+	qid_t projid;
+	char *path;
+	int ret = 0;
+
+	if (stat_entry(frame->fd, name, &st) == -1) {
+		if (entry_vanished(errno))
+			return 0;
+		path = walker_path(w, w->depth, NULL);
+		errstr(_("lstat: Cannot stat `%s/%s': %s\nGuess you'd better run fsck first !\nexiting...\n"),
+			path, name, strerror(errno));
+		free(path);
+		return -1;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if (st.st_dev != cur_dev)
+			return 0;
+		walker_add_name(w, st.st_ino, name);
+		w->dirs_done++;
+		ret = 1;
+	}
+	else {
+		debug(FL_DEBUG, _("\tAdding %s size %lld ino %d links %d uid %u gid %u\n"), name,
+		      (long long)st.st_size, (int)st.st_ino, (int)st.st_nlink, (int)st.st_uid, (int)st.st_gid);
+		w->files_done++;
+	}
+	if (get_projid(frame->fd, name, &st, frame->projid, frame->projinherit, &projid) < 0)
+		return -1;
+	qspace = getqsize(frame->fd, name, &st);
+	add_to_quota(w->dquot_hash, &w->arena, st.st_ino, st.st_uid, st.st_gid, projid,
+		     st.st_mode, st.st_nlink, qspace, !ret);
+	return ret;
+}
+
+/* Remember directory entry to stat it later */
+static void walker_add_dirent(struct scan_walker *w, ino_t ino, const char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	if (w->ents_len == w->ents_size) {
+		w->ents_size = w->ents_size ? w->ents_size * 2 : 256;
+		w->ents = srealloc(w->ents, sizeof(struct scan_dirent) * w->ents_size);
+	}
+	if (w->entnames_len + len > w->entnames_size) {
+		w->entnames_size = (w->entnames_len + len) * 2;
+		w->entnames = srealloc(w->entnames, w->entnames_size);
+	}
+	memcpy(w->entnames + w->entnames_len, name, len);
+	w->ents[w->ents_len].ino = ino;
+	w->ents[w->ents_len++].name = w->entnames_len;
+	w->entnames_len += len;
+}
+
+static int dirent_cmp(const void *a, const void *b)
+{
+	const struct scan_dirent *da = a, *db = b;
+
+	if (da->ino < db->ino)
+		return -1;
+	return da->ino > db->ino;
+}
+
+/*
+ * Read the directory on top of walker stack and stat its entries. With
+ * FL_SORTINODES we first read all the entries and then stat them in order
+ * of inode numbers so that inode tables are read sequentially and not in
+ * (hash) order of directory entries.
+ */
+static int walker_read_dir(struct scan_walker *w)
+{
+	struct scan_frame *frame = &w->frames[w->depth - 1];
+	struct dirent *de;
+	char *path;
+	int dfd, ret, subdirs = 0;
+	size_t i;
+	DIR *dp;
+
+	if ((dfd = dup(frame->fd)) < 0 || !(dp = fdopendir(dfd))) {
+		path = walker_path(w, w->depth, NULL);
+		errstr(_("\nCannot open directory %s: %s\n"), path, strerror(errno));
+		free(path);
+		if (dfd >= 0)
+			close(dfd);
+		return -1;
+	}
+
+	/* Output is shared by all walkers so only one of them updates it */
+	if (w->verbose && flags & (FL_VERYVERBOSE | FL_DEBUG)) {
+		path = walker_path(w, w->depth, NULL);
+		debug(FL_DEBUG, _("Entering directory %s\n"), path);
+		if (flags & FL_VERYVERBOSE)
+			blit(path);
+		free(path);
+	}
+	w->ents_len = w->entnames_len = 0;
+	while ((de = readdir(dp)) != (struct dirent *)NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (flags & FL_SORTINODES) {
+			walker_add_dirent(w, de->d_ino, de->d_name);
+			continue;
+		}
+		if (w->verbose && flags & FL_VERBOSE)
+			blit(NULL);
+		if ((ret = walker_stat_entry(w, de->d_name)) < 0) {
+			closedir(dp);
+			return -1;
+		}
+		subdirs += ret;
+	}
+	closedir(dp);
+
+	if (w->ents_len > 1)
+		qsort(w->ents, w->ents_len, sizeof(struct scan_dirent), dirent_cmp);
+	for (i = 0; i < w->ents_len; i++) {
+		if (w->verbose && flags & FL_VERBOSE)
+			blit(NULL);
+		if ((ret = walker_stat_entry(w, w->entnames + w->ents[i].name)) < 0)
+			return -1;
+		subdirs += ret;
+	}
+
+	if (subdirs && progress.fd >= 0)
+		__atomic_add_fetch(&progress.queued, subdirs, __ATOMIC_RELAXED);
+	if (subdirs && scan_threads > 1) {
+		__atomic_add_fetch(&scan_pending, subdirs, __ATOMIC_SEQ_CST);
+		walker_lock(w);
+		frame->end = w->names_len;
+		walker_unlock(w);
+		pthread_cond_broadcast(&scan_idle_cond);
+	}
+	else {
+		frame->end = w->names_len;
+	}
+	return 0;
+}
+
+/*
+ * Checkpoints. Serial scan periodically saves the walker stack and names
+ * arena, usage gathered so far and the hardlink table so that it can be
+ * resumed if quotacheck gets interrupted. Resuming is allowed only if the
+ * filesystem stayed read-only and unchanged since the checkpoint was written.
+ */
+
+/* Get state of the filesystem to detect changes between checkpoint and resume */
+static void get_fs_state(struct mount_entry *mnt, struct fs_state *state)
+{
+	struct statvfs sv;
+	unsigned char sb[1024];
+	int fd;
+
+	memset(state, 0, sizeof(*state));
+	state->dev = mnt->me_dev;
+	if (statvfs(mnt->me_dir, &sv) == 0) {
+		state->blocks = sv.f_blocks;
+		state->bfree = sv.f_bfree;
+		state->files = sv.f_files;
+		state->ffree = sv.f_ffree;
+	}
+	/* Superblock of ext2/3/4 counts mounts and writes */
+	fd = open(mnt->me_devname, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (pread(fd, sb, sizeof(sb), 1024) == sizeof(sb) &&
+	    (sb[0x38] | sb[0x39] << 8) == 0xEF53) {
+		state->sb_wtime = le32toh(*(uint32_t *)(sb + 0x30));
+		state->sb_mnt_count = sb[0x34] | sb[0x35] << 8;
+		state->sb_kbytes_written = le64toh(*(uint64_t *)(sb + 0x178));
+	}
+	close(fd);
+}
+
+/* Is the filesystem mounted read-only? */
+static int fs_readonly(struct mount_entry *mnt)
+{
+	struct statvfs sv;
+
+	return statvfs(mnt->me_dir, &sv) == 0 && sv.f_flag & ST_RDONLY;
+}
+
+static int checkpoint_write(FILE *f, const void *buf, size_t len)
+{
+	return fwrite(buf, 1, len, f) == len ? 0 : -1;
+}
+
+/* Save state of the scan. The file is replaced atomically. */
+static int write_checkpoint(struct scan_walker *w)
+{
+	struct checkpoint_header hdr;
+	struct checkpoint_frame cf;
+	struct checkpoint_dquot cd;
+	struct checkpoint_link cl;
+	struct dquot *dquot;
+	char *tmpname;
+	FILE *f;
+	int i, type, ret = 0;
+	uint j;
+
+	tmpname = xmalloc(strlen(checkpoint_file) + 5);
+	sprintf(tmpname, "%s.tmp", checkpoint_file);
+	f = fopen(tmpname, "w");
+	if (!f) {
+		free(tmpname);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+	hdr.fs = scan_fs_state;
+	hdr.check[USRQUOTA] = ucheck;
+	hdr.check[GRPQUOTA] = gcheck;
+	hdr.check[PRJQUOTA] = pcheck;
+	hdr.files_done = w->files_done;
+	hdr.dirs_done = w->dirs_done;
+	hdr.depth = w->depth;
+	hdr.names_len = w->names_len;
+	for (type = 0; type < MAXQUOTAS; type++)
+		hdr.dquots[type] = dquot_hash[type].count;
+	for (j = 0; j < LINKSHARDS; j++)
+		hdr.links += links_hash[j].used;
+	ret |= checkpoint_write(f, &hdr, sizeof(hdr));
+	for (i = 0; i < w->depth; i++) {
+		memset(&cf, 0, sizeof(cf));
+		cf.name = w->frames[i].name;
+		cf.start = w->frames[i].start;
+		cf.next = w->frames[i].next;
+		cf.end = w->frames[i].end;
+		cf.projid = w->frames[i].projid;
+		cf.projinherit = w->frames[i].projinherit;
+		ret |= checkpoint_write(f, &cf, sizeof(cf));
+	}
+	ret |= checkpoint_write(f, w->names, w->names_len);
+	for (type = 0; type < MAXQUOTAS; type++)
+		for (j = 0; j < dquot_hash[type].size; j++)
+			for (dquot = dquot_hash[type].hash[j]; dquot; dquot = dquot->dq_next) {
+				memset(&cd, 0, sizeof(cd));
+				cd.id = dquot->dq_id;
+				cd.curinodes = dquot->dq_dqb.dqb_curinodes;
+				cd.curspace = dquot->dq_dqb.dqb_curspace;
+				ret |= checkpoint_write(f, &cd, sizeof(cd));
+			}
+	for (j = 0; j < LINKSHARDS; j++) {
+		uint pos;
+
+		for (pos = 0; pos < links_hash[j].size; pos++) {
+			if (!links_hash[j].table[pos].i_num)
+				continue;
+			cl.i_num = links_hash[j].table[pos].i_num;
+			cl.seen = links_hash[j].table[pos].seen;
+			ret |= checkpoint_write(f, &cl, sizeof(cl));
+		}
+	}
+	if (fflush(f) == EOF || fsync(fileno(f)) < 0)
+		ret = -1;
+	if (fclose(f) == EOF)
+		ret = -1;
+	if (!ret && rename(tmpname, checkpoint_file) < 0)
+		ret = -1;
+	if (ret < 0)
+		unlink(tmpname);
+	else
+		debug(FL_DEBUG, _("Checkpoint written after %d directories and %d files\n"),
+		      w->dirs_done, w->files_done);
+	free(tmpname);
+	return ret;
+}
+
+static int checkpoint_read(FILE *f, void *buf, size_t len)
+{
+	return fread(buf, 1, len, f) == len ? 0 : -1;
+}
+
+/*
+ * Load walker state, usage and hardlinks from checkpoint and reopen
+ * directories on the stack. Returns 1 if there's no usable checkpoint, in
+ * which case nothing from the checkpoint is left in the walker or in the
+ * global tables.
+ */
+static int read_checkpoint(struct scan_walker *w, const char *pathname)
+{
+	struct checkpoint_header hdr;
+	struct checkpoint_frame cf;
+	struct checkpoint_dquot cd;
+	struct checkpoint_link cl;
+	struct scan_frame *frame;
+	struct dquot_table cp_hash[MAXQUOTAS];
+	struct dquot *dquot;
+	struct stat st;
+	ino_t ino;
+	FILE *f;
+	int i, type, fd;
+	uint64_t j;
+
+	f = fopen(checkpoint_file, "r");
+	if (!f) {
+		debug(FL_DEBUG | FL_VERBOSE, _("Checkpoint %s not found, starting the scan from the beginning.\n"),
+		      checkpoint_file);
+		return 1;
+	}
+	/* Usage is merged only once we know the checkpoint can be used */
+	memset(cp_hash, 0, sizeof(cp_hash));
+	if (checkpoint_read(f, &hdr, sizeof(hdr)) < 0 ||
+	    memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.depth < 1 || hdr.names_len < sizeof(ino_t) + 1) {
+		errstr(_("Checkpoint %s is corrupted, starting the scan from the beginning.\n"),
+		       checkpoint_file);
+		goto out_ignore;
+	}
+	if (memcmp(&hdr.fs, &scan_fs_state, sizeof(hdr.fs)) || hdr.check[USRQUOTA] != ucheck ||
+	    hdr.check[GRPQUOTA] != gcheck || hdr.check[PRJQUOTA] != pcheck) {
+		errstr(_("Filesystem or checked quota types changed since checkpoint %s was written, starting the scan from the beginning.\n"),
+		       checkpoint_file);
+		goto out_ignore;
+	}
+
+	w->frames_size = hdr.depth;
+	w->frames = srealloc(w->frames, sizeof(struct scan_frame) * w->frames_size);
+	for (i = 0; i < hdr.depth; i++) {
+		if (checkpoint_read(f, &cf, sizeof(cf)) < 0 || cf.name >= hdr.names_len ||
+		    cf.start > cf.next || cf.next > cf.end || cf.end > hdr.names_len)
+			goto out_corrupted;
+		frame = &w->frames[i];
+		frame->fd = -1;
+		frame->name = cf.name;
+		frame->start = cf.start;
+		frame->next = cf.next;
+		frame->end = cf.end;
+		frame->projid = cf.projid;
+		frame->projinherit = cf.projinherit;
+	}
+	w->names_size = hdr.names_len;
+	w->names = srealloc(w->names, w->names_size);
+	if (checkpoint_read(f, w->names, hdr.names_len) < 0 || w->names[hdr.names_len - 1])
+		goto out_corrupted;
+	w->names_len = hdr.names_len;
+	if (strcmp(walker_name(w, 0), pathname)) {
+		errstr(_("Checkpoint %s was written for a scan of %s, starting the scan from the beginning.\n"),
+		       checkpoint_file, walker_name(w, 0));
+		goto out_ignore;
+	}
+	for (type = 0; type < MAXQUOTAS; type++) {
+		for (j = 0; j < hdr.dquots[type]; j++) {
+			if (checkpoint_read(f, &cd, sizeof(cd)) < 0)
+				goto out_corrupted;
+			if ((dquot = find_dquot(&cp_hash[type], cd.id)) == NODQUOT)
+				dquot = insert_dquot(&cp_hash[type], &w->arena, cd.id, type);
+			dquot->dq_dqb.dqb_curinodes += cd.curinodes;
+			dquot->dq_dqb.dqb_curspace += cd.curspace;
+		}
+	}
+	for (j = 0; j < hdr.links; j++) {
+		if (checkpoint_read(f, &cl, sizeof(cl)) < 0)
+			goto out_corrupted;
+		restore_dlinks(cl.i_num, cl.seen);
+	}
+	fclose(f);
+
+	/* Reopen directories on the stack */
+	for (i = 0; i < hdr.depth; i++) {
+		frame = &w->frames[i];
+		if (!i)
+			fd = open(pathname, O_RDONLY | O_DIRECTORY);
+		else
+			fd = openat(w->frames[i - 1].fd, walker_name(w, frame->name),
+				    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		memcpy(&ino, w->names + frame->name, sizeof(ino_t));
+		if (fd < 0 || fstat(fd, &st) < 0 || st.st_ino != ino) {
+			char *path = walker_path(w, i + 1, NULL);
+
+			errstr(_("Cannot reopen directory %s from checkpoint, starting the scan from the beginning.\n"),
+			       path);
+			free(path);
+			if (fd >= 0)
+				close(fd);
+			w->depth = i;
+			goto out_discard;
+		}
+		frame->fd = fd;
+		w->depth = i + 1;
+		if (w->depth - w->closed > max_open_dirs) {
+			close(w->frames[w->closed].fd);
+			w->frames[w->closed++].fd = -1;
+		}
+	}
+	merge_dquots(cp_hash);
+	w->files_done = hdr.files_done;
+	w->dirs_done = hdr.dirs_done;
+	if (progress.fd >= 0) {
+		for (i = 0; i < w->depth; i++) {
+			size_t name;
+
+			for (name = w->frames[i].next; name < w->frames[i].end;
+			     name = walker_next_name(w, name))
+				progress.queued++;
+		}
+	}
+	debug(FL_DEBUG | FL_VERBOSE, _("Resuming scan after %d directories and %d files.\n"),
+	      w->dirs_done, w->files_done);
+	return 0;
+out_corrupted:
+	errstr(_("Checkpoint %s is corrupted, starting the scan from the beginning.\n"),
+	       checkpoint_file);
+	fclose(f);
+out_discard:
+	walker_reset(w);
+	for (type = 0; type < MAXQUOTAS; type++)
+		free_dquot_table(&cp_hash[type]);
+	free_dlinks();
+	return 1;
+out_ignore:
+	fclose(f);
+	return 1;
+}
+
+/* Ask running scan to save a checkpoint and stop */
+static void scan_interrupt(int sig)
+{
+	scan_interrupted = 1;
+}
+
+/* Scan everything below directories on walker stack */
+static int walker_run(struct scan_walker *w)
+{
+	struct scan_frame *top;
+	size_t name;
+	char *path;
+	int fd, ret;
+
+	while (w->depth) {
+		if (scan_threads > 1 && __atomic_load_n(&scan_failed, __ATOMIC_SEQ_CST))
+			return -1;
+		if (checkpointing && (scan_interrupted || time(NULL) >= next_checkpoint)) {
+			if (write_checkpoint(w) < 0)
+				errstr(_("Cannot write checkpoint %s: %s\n"), checkpoint_file,
+				       strerror(errno));
+			next_checkpoint = time(NULL) + checkpoint_interval;
+			if (scan_interrupted) {
+				errstr(_("Scan interrupted. Use --resume to continue it.\n"));
+				return -1;
+			}
+		}
+		walker_lock(w);
+		top = &w->frames[w->depth - 1];
+		if (top->next == top->end) {
+			walker_unlock(w);
+			if (walker_pop(w) < 0)
+				return -1;
+			continue;
+		}
+		name = top->next;
+		top->next = walker_next_name(w, name);
+		walker_unlock(w);
+		if (progress.fd >= 0)
+			__atomic_sub_fetch(&progress.queued, 1, __ATOMIC_RELAXED);
+
+		fd = openat(top->fd, walker_name(w, name), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd < 0) {
+			if (entry_vanished(errno)) {
+				finish_dir();
+				continue;
+			}
+			path = walker_path(w, w->depth, walker_name(w, name));
+			errstr(_("Cannot open directory %s: %s\n"), path, strerror(errno));
+			free(path);
+			return -1;
+		}
+		if (walker_push(w, fd, name) < 0)
+			return -1;
+		ret = walker_read_dir(w);
+		finish_dir();
+		if (ret < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Scan directory tree starting at given path. If account is set, the
+ * directory itself is added to quotas as well.
+ */
+static int walker_start(struct scan_walker *w, const char *pathname, int account)
+{
+	struct stat st;
+	loff_t qspace;
+	int fd, ret;
+
+	if ((fd = open(pathname, O_RDONLY | O_DIRECTORY)) < 0 || fstat(fd, &st) < 0) {
+		int err = errno;
+
+		if (fd >= 0)
+			close(fd);
+		finish_dir();
+		/* Stolen directory was moved or deleted, the change gets fixed later */
+		if (entry_vanished(err))
+			return 0;
+		errstr(_("Cannot open directory %s: %s\n"), pathname, strerror(err));
+		return -1;
+	}
+	/* The walker is empty so the name of the directory will be the first one */
+	w->names_len = 0;
+	walker_add_name(w, st.st_ino, pathname);
+	if (walker_push(w, fd, 0) < 0) {
+		finish_dir();
+		return -1;
+	}
+	if (account) {
+		qspace = getqsize(AT_FDCWD, pathname, &st);
+		add_to_quota(w->dquot_hash, &w->arena, st.st_ino, st.st_uid, st.st_gid, w->frames[0].projid,
+			     st.st_mode, st.st_nlink, qspace, 0);
+	}
+	ret = walker_read_dir(w);
+	finish_dir();
+	if (ret < 0 || walker_run(w) < 0) {
+		walker_reset(w);
+		return -1;
+	}
+	return 0;
+}
+
+/* Compute how many directories each walker can keep open */
+static void set_max_open_dirs(void)
+{
+	struct rlimit rlim;
+
+	max_open_dirs = MAXOPENDIRS;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 || rlim.rlim_cur == RLIM_INFINITY)
+		return;
+	/* Leave some descriptors for quota files and directories being read */
+	if (rlim.rlim_cur < MAXOPENDIRS * scan_threads + 32)
+		max_open_dirs = ((long)rlim.rlim_cur - 32) / scan_threads - 2;
+	if (max_open_dirs < 2)
+		max_open_dirs = 2;
+}
+
+/* Free walker buffers. Dquots are moved to the main arena. */
+static void walker_free(struct scan_walker *w)
+{
+	arena_splice(&dquot_arena, &w->arena);
+	walk_mem += w->frames_size * sizeof(struct scan_frame) + w->names_size +
+		    w->ents_size * sizeof(struct scan_dirent) + w->entnames_size;
+	free(w->frames);
+	free(w->names);
+	free(w->ents);
+	free(w->entnames);
+}
+
+/*
+ * Scan a directory tree. Stat the files and add the sizes of the files to
+ * the appropriate quotas.
+ */
+static int scan_dir(const char *pathname)
+{
+	struct scan_walker w;
+	int ret;
+
+	set_max_open_dirs();
+	memset(&w, 0, sizeof(w));
+	w.dquot_hash = dquot_hash;
+	w.verbose = 1;
+	ret = 1;
+	if (checkpointing && resume) {
+		ret = read_checkpoint(&w, pathname);
+		if (!ret) {
+			ret = walker_run(&w);
+			if (ret < 0)
+				walker_reset(&w);
+		}
+	}
+	if (ret > 0)
+		ret = walker_start(&w, pathname, 1);
+	if (checkpointing && !ret)
+		unlink(checkpoint_file);
+	files_done += w.files_done;
+	dirs_done += w.dirs_done;
+	walker_free(&w);
+	return ret;
+}
+
+/* Take a directory waiting for scan from another walker */
+static char *walker_steal(struct scan_walker *w)
+{
+	struct scan_frame *frame;
+	char *path = NULL;
+	size_t name;
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	for (i = 0; i < w->depth; i++) {
+		frame = &w->frames[i];
+		if (frame->next < frame->end) {
+			name = frame->next;
+			frame->next = walker_next_name(w, name);
+			path = walker_path(w, i + 1, walker_name(w, name));
+			if (progress.fd >= 0)
+				__atomic_sub_fetch(&progress.queued, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	return path;
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_worker *sw = arg;
+	struct timespec ts;
+	char *dir;
+	int i;
+
+	if (sw->start && walker_start(&sw->walk, sw->start, 1) < 0)
+		__atomic_store_n(&scan_failed, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&scan_failed, __ATOMIC_SEQ_CST)) {
+		dir = NULL;
+		for (i = 1; i < scan_threads && !dir; i++)
+			dir = walker_steal(&scan_workers[(sw->idx + i) % scan_threads].walk);
+		if (dir) {
+			if (walker_start(&sw->walk, dir, 0) < 0)
+				__atomic_store_n(&scan_failed, 1, __ATOMIC_SEQ_CST);
+			free(dir);
+			continue;
+		}
+		if (!__atomic_load_n(&scan_pending, __ATOMIC_SEQ_CST))
+			break;
+		/* Nothing to steal yet. Wait until somebody finds more directories. */
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SCAN_IDLE_WAIT;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&scan_idle_lock);
+		pthread_cond_timedwait(&scan_idle_cond, &scan_idle_lock, &ts);
+		pthread_mutex_unlock(&scan_idle_lock);
+	}
+	return NULL;
+}
+
 #if defined(EXT2_DIRECT)
-static int ext2_direct_scan(const char *device)
+/*
+ * Direct scan of ext2/3/4 inode tables. Block groups are handed out to
+ * scanning threads in chunks (a multiple of flex_bg size so that a thread
+ * reads inode tables which are next to each other). Each thread has its own
+ * filesystem handle since libext2fs handles are not thread safe.
+ */
+#define EXT2_SCAN_CHUNK 64		/* Minimal number of groups thread takes at once */
+#define EXT2_SCAN_BUFFER_BLOCKS 2048	/* Maximal size of inode buffer (in blocks) */
+#define EXT2_SCAN_GROUP_DONE ((errcode_t)-1)	/* Scan of a group finished */
+
+/* State of one thread of direct ext2 scan */
+struct ext2_scanner {
+	pthread_t thread;
+	int idx;			/* Index of the thread */
+	const char *device;		/* Device with the filesystem */
+	struct dquot_table *dquot_hash;	/* Usage gathered by this thread */
+	struct arena arena;		/* Arena for dquots of this thread */
+	int files_done, dirs_done;
+	int ret;			/* Result of the scan */
+};
+
+static unsigned long ext2_next_group;	/* First group not yet taken by any thread */
+
+/* Stop the scan at the end of each group so that we never read tables we don't want */
+static errcode_t ext2_group_done(ext2_filsys fs, ext2_inode_scan scan, dgrp_t group, void *priv)
+{
+	return EXT2_SCAN_GROUP_DONE;
+}
+
+/* Get project ID of an inode (if the inode is large enough to have one) */
+static qid_t ext2_inode_projid(ext2_filsys fs, struct ext2_inode_large *inode)
+{
+	if (EXT2_INODE_SIZE(fs->super) <= EXT2_GOOD_OLD_INODE_SIZE ||
+	    EXT2_GOOD_OLD_INODE_SIZE + inode->i_extra_isize <
+	    offsetof(struct ext2_inode_large, i_projid) + sizeof(inode->i_projid))
+		return 0;
+	return inode->i_projid;
+}
+
+static void *ext2_scan_groups(void *arg)
 {
+	struct ext2_scanner *sc = arg;
 	ext2_ino_t i_num;
 	ext2_filsys fs;
 	errcode_t error;
 	ext2_inode_scan scan;
-	struct ext2_inode inode;
-	int inode_buffer_blocks = 0;
-	ext2fs_inode_bitmap inode_used_map;
-	ext2fs_inode_bitmap inode_dir_map;
+	struct ext2_inode_large inode;
+	unsigned long chunk, first, last, group;
+	int inode_buffer_blocks;
 	uid_t uid;
 	gid_t gid;
-	int ret = -1;
-
-	if ((error = ext2fs_open(device, 0, 0, 0, unix_io_manager, &fs))) {
-		errstr(_("error (%d) while opening %s\n"), (int)error, device);
-		return -1;
-	}
-
-	if ((error = ext2fs_allocate_inode_bitmap(fs, "in-use inode map", &inode_used_map))) {
-		errstr(_("error (%d) while allocating file inode bitmap\n"), (int)error);
-		goto out_free;
-	}
 
-	if ((error = ext2fs_allocate_inode_bitmap(fs, "directory inode map", &inode_dir_map))) {
-		errstr(_("errstr (%d) while allocating directory inode bitmap\n"), (int)error);
-		goto out_used_map;
+	sc->ret = -1;
+	if ((error = ext2fs_open(sc->device, 0, 0, 0, unix_io_manager, &fs))) {
+		errstr(_("error (%d) while opening %s\n"), (int)error, sc->device);
+		return NULL;
 	}
 
+	/* Read whole inode table of a group at once if it isn't too large */
+	inode_buffer_blocks = fs->inode_blocks_per_group;
+	if (inode_buffer_blocks > EXT2_SCAN_BUFFER_BLOCKS)
+		inode_buffer_blocks = EXT2_SCAN_BUFFER_BLOCKS;
 	if ((error = ext2fs_open_inode_scan(fs, inode_buffer_blocks, &scan))) {
 		errstr(_("error (%d) while opening inode scan\n"), (int)error);
-		goto out_dir_map;
-	}
-
-	if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
-		errstr(_("error (%d) while starting inode scan\n"), (int)error);
-		goto out_scan;
-	}
-
-	while (i_num) {
-		if ((i_num == EXT2_ROOT_INO ||
-		     i_num >= EXT2_FIRST_INO(fs->super)) &&
-		    inode.i_links_count) {
-			debug(FL_DEBUG, _("Found i_num %ld, blocks %ld\n"), (long)i_num, (long)inode.i_blocks);
-			if (flags & FL_VERBOSE)
-				blit(NULL);
-			uid = inode.i_uid | (inode.i_uid_high << 16);
-			gid = inode.i_gid | (inode.i_gid_high << 16);
-			if (inode.i_uid_high | inode.i_gid_high)
-				debug(FL_DEBUG, _("High uid detected.\n"));
-			if (ucheck)
-				add_to_quota(USRQUOTA, i_num, uid, gid,
-					     inode.i_mode, inode.i_links_count,
-					     ((loff_t)inode.i_blocks) << 9, 0);
-			if (gcheck)
-				add_to_quota(GRPQUOTA, i_num, uid, gid,
+		goto out_free;
+	}
+	ext2fs_set_inode_callback(scan, ext2_group_done, NULL);
+
+	chunk = EXT2_SCAN_CHUNK;
+	if (ext2fs_has_feature_flex_bg(fs->super) &&
+	    (1UL << fs->super->s_log_groups_per_flex) > chunk)
+		chunk = 1UL << fs->super->s_log_groups_per_flex;
+	while ((first = __atomic_fetch_add(&ext2_next_group, chunk, __ATOMIC_SEQ_CST)) <
+	       fs->group_desc_count) {
+		last = first + chunk;
+		if (last > fs->group_desc_count)
+			last = fs->group_desc_count;
+		for (group = first; group < last; group++) {
+			/* Skip groups without any used inode */
+			if (ext2fs_bg_free_inodes_count(fs, group) == fs->super->s_inodes_per_group)
+				continue;
+			if ((error = ext2fs_inode_scan_goto_blockgroup(scan, group))) {
+				errstr(_("error (%d) while starting inode scan\n"), (int)error);
+				goto out_scan;
+			}
+			while (!(error = ext2fs_get_next_inode_full(scan, &i_num,
+					(struct ext2_inode *)&inode, sizeof(inode))) && i_num) {
+				if ((i_num != EXT2_ROOT_INO &&
+				     i_num < EXT2_FIRST_INO(fs->super)) ||
+				    !inode.i_links_count)
+					continue;
+				debug(FL_DEBUG, _("Found i_num %ld, blocks %ld\n"), (long)i_num, (long)inode.i_blocks);
+				/* Output is shared by all threads so only one of them updates it */
+				if (!sc->idx && flags & FL_VERBOSE)
+					blit(NULL);
+				uid = inode.i_uid | (inode.i_uid_high << 16);
+				gid = inode.i_gid | (inode.i_gid_high << 16);
+				if (inode.i_uid_high | inode.i_gid_high)
+					debug(FL_DEBUG, _("High uid detected.\n"));
+				add_to_quota(sc->dquot_hash, &sc->arena, i_num, uid, gid,
+					     pcheck ? ext2_inode_projid(fs, &inode) : 0,
 					     inode.i_mode, inode.i_links_count,
 					     ((loff_t)inode.i_blocks) << 9, 0);
-			if (S_ISDIR(inode.i_mode))
-				dirs_done++;
-			else
-				files_done++;
-		}
-
-		if ((error = ext2fs_get_next_inode(scan, &i_num, &inode))) {
-			errstr(_("Something weird happened while scanning. Error %d\n"), (int)error);
-			goto out_scan;
+				if (S_ISDIR(inode.i_mode))
+					sc->dirs_done++;
+				else
+					sc->files_done++;
+			}
+			if (error && error != EXT2_SCAN_GROUP_DONE) {
+				errstr(_("Something weird happened while scanning. Error %d\n"), (int)error);
+				goto out_scan;
+			}
 		}
 	}
-	ret = 0;
+	sc->ret = 0;
 out_scan:
 	ext2fs_close_inode_scan(scan);
-out_dir_map:
-	ext2fs_free_inode_bitmap(inode_dir_map);
-out_used_map:
-	ext2fs_free_inode_bitmap(inode_used_map);
 out_free:
 	ext2fs_free(fs);
-	return ret;
+	return NULL;
 }
-#endif
 
 /*
- * Scan a directory with the readdir systemcall. Stat the files and add the sizes
- * of the files to the appropriate quotas. When we find a dir we recursivly call
- * ourself to scan that dir.
+ * Scan inode tables of the filesystem on given device with scan_threads
+ * threads.
  */
-static int scan_dir(const char *pathname)
+static int ext2_direct_scan(const char *device)
 {
-	struct dirs *dir_stack = NULL;
-	struct dirs *new_dir;
-	struct dirent *de;
-	struct stat st;
-	loff_t qspace;
-	DIR *dp;
-	int ret;
-
-	if (lstat(pathname, &st) == -1) {
-		errstr(_("Cannot stat directory %s: %s\n"), pathname, strerror(errno));
-		goto out;
+	struct ext2_scanner *scanners, *sc;
+	int i, ret = 0;
+
+	scanners = xmalloc(sizeof(struct ext2_scanner) * scan_threads);
+	ext2_next_group = 0;
+	for (i = 0; i < scan_threads; i++) {
+		sc = &scanners[i];
+		sc->idx = i;
+		sc->device = device;
+		sc->dquot_hash = i ? xmalloc(sizeof(struct dquot_table) * MAXQUOTAS) : dquot_hash;
 	}
-	qspace = getqsize(pathname, &st);
-	if (ucheck)
-		add_to_quota(USRQUOTA, st.st_ino, st.st_uid, st.st_gid, st.st_mode,
-			     st.st_nlink, qspace, 0);
-	if (gcheck)
-		add_to_quota(GRPQUOTA, st.st_ino, st.st_uid, st.st_gid, st.st_mode,
-			     st.st_nlink, qspace, 0);
-
-	if (chdir(pathname) == -1) {
-		errstr(_("Cannot chdir to %s: %s\n"), pathname, strerror(errno));
-		goto out;
+	for (i = 1; i < scan_threads; i++) {
+		ret = pthread_create(&scanners[i].thread, NULL, ext2_scan_groups, &scanners[i]);
+		if (ret)
+			die(2, _("Cannot create scanning thread: %s\n"), strerror(ret));
 	}
-
-	if ((dp = opendir(".")) == (DIR *) NULL)
-		die(2, _("\nCannot open directory %s: %s\n"),
-		    pathname, strerror(errno));
-
-	if (flags & FL_VERYVERBOSE)
-		blit(pathname);
-	while ((de = readdir(dp)) != (struct dirent *)NULL) {
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
-		if (flags & FL_VERBOSE)
-			blit(NULL);
-
-		if ((lstat(de->d_name, &st)) == -1) {
-			errstr(_("lstat: Cannot stat `%s/%s': %s\nGuess you'd better run fsck first !\nexiting...\n"),
-				pathname, de->d_name, strerror(errno));
-			closedir(dp);
-			goto out;
-		}
-
-		if (S_ISDIR(st.st_mode)) {
-			if (st.st_dev != cur_dev)
-				continue;
-			/*
-			 * Add this to the directory stack and check this later on.
-			 */
-			debug(FL_DEBUG, _("pushd %s/%s\n"), pathname, de->d_name);
-			new_dir = xmalloc(sizeof(struct dirs));
-
-			new_dir->dir_name = xmalloc(strlen(pathname) + strlen(de->d_name) + 2);
-			sprintf(new_dir->dir_name, "%s/%s", pathname, de->d_name);
-			new_dir->next = dir_stack;
-			dir_stack = new_dir;
-		}
-		else {
-			qspace = getqsize(de->d_name, &st);
-			if (ucheck)
-				add_to_quota(USRQUOTA, st.st_ino, st.st_uid, st.st_gid, st.st_mode,
-					     st.st_nlink, qspace, 1);
-			if (gcheck)
-				add_to_quota(GRPQUOTA, st.st_ino, st.st_uid, st.st_gid, st.st_mode,
-					     st.st_nlink, qspace, 1);
-			debug(FL_DEBUG, _("\tAdding %s size %lld ino %d links %d uid %u gid %u\n"), de->d_name,
-			      (long long)st.st_size, (int)st.st_ino, (int)st.st_nlink, (int)st.st_uid, (int)st.st_gid);
-			files_done++;
+	ext2_scan_groups(&scanners[0]);
+	for (i = 1; i < scan_threads; i++)
+		pthread_join(scanners[i].thread, NULL);
+
+	for (i = 0; i < scan_threads; i++) {
+		sc = &scanners[i];
+		if (i) {
+			merge_dquots(sc->dquot_hash);
+			free(sc->dquot_hash);
 		}
+		arena_splice(&dquot_arena, &sc->arena);
+		files_done += sc->files_done;
+		dirs_done += sc->dirs_done;
+		ret |= sc->ret;
 	}
-	closedir(dp);
-
-	/*
-	 * Traverse the directory stack, and check it.
-	 */
-	debug(FL_DEBUG, _("Scanning stored directories from directory stack\n"));
-	while (dir_stack != (struct dirs *)NULL) {
-		new_dir = dir_stack;
-		dir_stack = dir_stack->next;
-		debug(FL_DEBUG, _("popd %s\nEntering directory %s\n"), new_dir->dir_name,
-		      new_dir->dir_name);
-		ret = scan_dir(new_dir->dir_name);
-		dirs_done++;
-#ifdef DEBUG_MALLOC
-		free_mem += sizeof(struct dirs) + strlen(new_dir->dir_name) + 1;
+	free(scanners);
+	return ret;
+}
 #endif
-		free(new_dir->dir_name);
-		free(new_dir);
-		if (ret < 0)	/* Error while scanning? */
-			goto out;
+
+/*
+ * Scan the directory tree with scan_threads threads.
+ */
+static int scan_dir_parallel(const char *pathname)
+{
+	struct scan_worker *sw;
+	int i, ret;
+
+	set_max_open_dirs();
+	scan_workers = xmalloc(sizeof(struct scan_worker) * scan_threads);
+	for (i = 0; i < LINKSHARDS; i++)
+		pthread_mutex_init(&links_hash[i].lock, NULL);
+	for (i = 0; i < scan_threads; i++) {
+		sw = &scan_workers[i];
+		sw->idx = i;
+		pthread_mutex_init(&sw->walk.lock, NULL);
+		sw->walk.dquot_hash = xmalloc(sizeof(struct dquot_table) * MAXQUOTAS);
 	}
-	debug(FL_DEBUG, _("Leaving %s\n"), pathname);
-	return 0;
-      out:
-	for (new_dir = dir_stack; new_dir; new_dir = dir_stack) {
-		dir_stack = dir_stack->next;
-#ifdef DEBUG_MALLOC
-		free_mem += sizeof(struct dirs) + strlen(new_dir->dir_name) + 1;
-#endif
-		free(new_dir->dir_name);
-		free(new_dir);
+	scan_workers[0].start = pathname;
+	scan_workers[0].walk.verbose = 1;
+	scan_pending = 1;
+	scan_failed = 0;
+
+	for (i = 0; i < scan_threads; i++) {
+		ret = pthread_create(&scan_workers[i].thread, NULL, scan_worker, &scan_workers[i]);
+		if (ret)
+			die(2, _("Cannot create scanning thread: %s\n"), strerror(ret));
 	}
-	return -1;
+	for (i = 0; i < scan_threads; i++)
+		pthread_join(scan_workers[i].thread, NULL);
+
+	for (i = 0; i < scan_threads; i++) {
+		sw = &scan_workers[i];
+		merge_dquots(sw->walk.dquot_hash);
+		files_done += sw->walk.files_done;
+		dirs_done += sw->walk.dirs_done;
+		free(sw->walk.dquot_hash);
+		walker_free(&sw->walk);
+		pthread_mutex_destroy(&sw->walk.lock);
+	}
+	for (i = 0; i < LINKSHARDS; i++)
+		pthread_mutex_destroy(&links_hash[i].lock);
+	free(scan_workers);
+	scan_workers = NULL;
+	return scan_failed ? -1 : 0;
 }
 
 /* Ask user y/n question */
@@ -771,105 +2534,640 @@ rename_new:
 		free(filename);
 		return -1;
 	}
-#ifdef EXT2_DIRECT
-	if (ext2_flags != -1) {
-		if ((fd = open(filename, O_RDONLY)) < 0) {
-			errstr(_("Cannot open new quota file %s: %s\n"), filename, strerror(errno));
-			free(filename);
-			return -1;
-		}
-		if (ioctl(fd, EXT2_IOC_SETFLAGS, &ext2_flags) < 0)
-			errstr(_("Warning: Cannot set EXT2 flags on %s: %s\n"), filename, strerror(errno));
-		close(fd);
+#ifdef EXT2_DIRECT
+	if (ext2_flags != -1) {
+		if ((fd = open(filename, O_RDONLY)) < 0) {
+			errstr(_("Cannot open new quota file %s: %s\n"), filename, strerror(errno));
+			free(filename);
+			return -1;
+		}
+		if (ioctl(fd, EXT2_IOC_SETFLAGS, &ext2_flags) < 0)
+			errstr(_("Warning: Cannot set EXT2 flags on %s: %s\n"), filename, strerror(errno));
+		close(fd);
+	}
+#endif
+	free(filename);
+	return 0;
+}
+
+/* Compare dquots by id */
+static int dquot_id_cmp(const void *a, const void *b)
+{
+	qid_t ida = (*(struct dquot * const *)a)->dq_id;
+	qid_t idb = (*(struct dquot * const *)b)->dq_id;
+
+	return ida < idb ? -1 : ida > idb;
+}
+
+/* Return array of gathered dquots of given type sorted by id */
+static struct dquot **sorted_dquots(int type, uint *cnt)
+{
+	struct dquot *dquot, **sorted;
+	uint i;
+
+	sorted = xmalloc(sizeof(struct dquot *) * (dquot_hash[type].count + 1));
+	*cnt = 0;
+	for (i = 0; i < dquot_hash[type].size; i++)
+		for (dquot = dquot_hash[type].hash[i]; dquot; dquot = dquot->dq_next)
+			sorted[(*cnt)++] = dquot;
+	qsort(sorted, *cnt, sizeof(struct dquot *), dquot_id_cmp);
+	return sorted;
+}
+
+/* Remember id whose entry in quota file needs updating */
+static void add_changed_id(qid_t id)
+{
+	if (changed_cnt == changed_size) {
+		changed_size = changed_size ? changed_size * 2 : 1024;
+		changed_ids = srealloc(changed_ids, sizeof(qid_t) * changed_size);
+	}
+	changed_ids[changed_cnt++] = id;
+}
+
+/* Compare usage in quota file or kernel with the computed one */
+static int compare_dquot(struct dquot *dquot, char *name)
+{
+	struct dquot *d = find_dquot(dquot_hash + changed_type, dquot->dq_id);
+
+	compared_cnt++;
+	if (!d) {
+		if (dquot->dq_dqb.dqb_curinodes || dquot->dq_dqb.dqb_curspace)
+			add_changed_id(dquot->dq_id);
+		return 0;
+	}
+	d->dq_flags |= DQ_FOUND;
+	if (d->dq_dqb.dqb_curinodes != dquot->dq_dqb.dqb_curinodes ||
+	    d->dq_dqb.dqb_curspace != dquot->dq_dqb.dqb_curspace)
+		add_changed_id(dquot->dq_id);
+	return 0;
+}
+
+static int qid_cmp(const void *a, const void *b)
+{
+	qid_t ida = *(const qid_t *)a;
+	qid_t idb = *(const qid_t *)b;
+
+	return ida < idb ? -1 : ida > idb;
+}
+
+/* Work shared by threads passing changed usage to the kernel */
+struct push_work {
+	struct quota_handle *h;
+	uint next;		/* First id not yet taken by any thread */
+	int failed;
+};
+
+/* Tell the kernel about usage of batches of changed ids */
+static void *push_worker(void *arg)
+{
+	struct push_work *work = arg;
+	struct dquot dq, *computed;
+	uint i, end;
+
+	memset(&dq, 0, sizeof(dq));
+	dq.dq_h = work->h;
+	while ((i = __atomic_fetch_add(&work->next, PUSH_BATCH, __ATOMIC_RELAXED)) < changed_cnt) {
+		end = i + PUSH_BATCH < changed_cnt ? i + PUSH_BATCH : changed_cnt;
+		for (; i < end; i++) {
+			computed = find_dquot(dquot_hash + changed_type, changed_ids[i]);
+			dq.dq_id = changed_ids[i];
+			dq.dq_dqb.dqb_curinodes = computed ? computed->dq_dqb.dqb_curinodes : 0;
+			dq.dq_dqb.dqb_curspace = computed ? computed->dq_dqb.dqb_curspace : 0;
+			debug(FL_DEBUG, _("Setting usage of id %u: %lld inodes, %lld bytes\n"),
+			      (unsigned int)dq.dq_id, (long long)dq.dq_dqb.dqb_curinodes,
+			      (long long)dq.dq_dqb.dqb_curspace);
+			if (work->h->qh_ops->commit_dquot(&dq, COMMIT_USAGE) < 0)
+				__atomic_store_n(&work->failed, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Pass usage of changed ids to the kernel. Each id needs a separate quotactl
+ * which is usually a separate filesystem transaction so issue them from
+ * several threads.
+ */
+static int push_changed(struct quota_handle *h)
+{
+	pthread_t threads[PUSH_THREADS];
+	struct push_work work = { .h = h };
+	int i, ret, cnt = (changed_cnt + PUSH_BATCH - 1) / PUSH_BATCH;
+
+	if (cnt > PUSH_THREADS)
+		cnt = PUSH_THREADS;
+	for (i = 1; i < cnt; i++) {
+		ret = pthread_create(threads + i, NULL, push_worker, &work);
+		if (ret) {
+			errstr(_("Cannot create thread: %s\n"), strerror(ret));
+			break;
+		}
+	}
+	cnt = i;
+	push_worker(&work);
+	for (i = 1; i < cnt; i++)
+		pthread_join(threads[i], NULL);
+	return work.failed ? -1 : 0;
+}
+
+/* Update entries one by one in a quota file not used by the kernel */
+static int update_changed(struct quota_handle *h)
+{
+	struct dquot *dquot, *d;
+	uint i;
+	int ret = 0;
+
+	for (i = 0; i < changed_cnt; i++) {
+		if (!(d = h->qh_ops->read_dquot(h, changed_ids[i]))) {
+			errstr(_("Cannot read quota structure for id %u: %s\n"),
+			       (unsigned int)changed_ids[i], strerror(errno));
+			ret = -1;
+			continue;
+		}
+		dquot = find_dquot(dquot_hash + changed_type, changed_ids[i]);
+		debug(FL_DEBUG, _("Updating usage of id %u: %lld inodes, %lld bytes (was %lld, %lld)\n"),
+		      (unsigned int)d->dq_id,
+		      dquot ? (long long)dquot->dq_dqb.dqb_curinodes : 0LL,
+		      dquot ? (long long)dquot->dq_dqb.dqb_curspace : 0LL,
+		      (long long)d->dq_dqb.dqb_curinodes, (long long)d->dq_dqb.dqb_curspace);
+		d->dq_dqb.dqb_curinodes = dquot ? dquot->dq_dqb.dqb_curinodes : 0;
+		d->dq_dqb.dqb_curspace = dquot ? dquot->dq_dqb.dqb_curspace : 0;
+		update_grace_times(d);
+		if (h->qh_ops->commit_dquot(d, COMMIT_USAGE | COMMIT_TIMES) < 0) {
+			errstr(_("Cannot write quota structure for id %u: %s\n"),
+			       (unsigned int)d->dq_id, strerror(errno));
+			ret = -1;
+		}
+		free(d);
+	}
+	return ret;
+}
+
+/*
+ * Update usage only for ids where it differs from the computed one. When
+ * quota is turned on (or is stored in hidden files or handled by XFS/GFS2),
+ * usage is compared with what the kernel reports and changes are passed to
+ * the kernel so there's no need to turn quotas off and rename files.
+ * Otherwise the existing quota file is updated in place.
+ */
+static int commit_in_place(struct mount_entry *mnt, int type, int qfmt)
+{
+	struct quota_handle *h;
+	struct dquot *dquot;
+	uint i;
+	int ret = 0;
+
+	if (!(h = init_io(mnt, type, qfmt, (qfmt == QF_XFS || qfmt == QF_META) ? IOI_READONLY : 0))) {
+		errstr(_("Cannot initialize IO on %s quota of %s: %s\n"),
+		       _(type2name(type)), mnt->me_dir, strerror(errno));
+		return -1;
+	}
+	changed_type = type;
+	changed_cnt = compared_cnt = 0;
+	/* Tree formats read usage from the file unless the kernel uses it */
+	if (is_tree_qfmt(h->qh_fmt) && h->qh_fd < 0)
+		ret = kernel_scan_dquots(h, compare_dquot);
+	else
+		ret = h->qh_ops->scan_dquots(h, compare_dquot);
+	if (ret < 0) {
+		errstr(_("Cannot get current %s quota usage on %s.\n"),
+		       _(type2name(type)), mnt->me_dir);
+		goto out;
+	}
+	/* Owners of new files and entries possibly added after we loaded the file */
+	for (i = 0; i < dquot_hash[type].size; i++)
+		for (dquot = dquot_hash[type].hash[i]; dquot; dquot = dquot->dq_next) {
+			if (dquot->dq_flags & DQ_FOUND)
+				dquot->dq_flags &= ~DQ_FOUND;
+			else if (dquot->dq_dqb.dqb_curinodes || dquot->dq_dqb.dqb_curspace) {
+				add_changed_id(dquot->dq_id);
+				compared_cnt++;
+			}
+		}
+	qsort(changed_ids, changed_cnt, sizeof(qid_t), qid_cmp);
+	if (h->qh_fd < 0)
+		ret = push_changed(h);
+	else
+		ret = update_changed(h);
+	debug(FL_DEBUG | FL_VERBOSE, _("Updated %u of %u %s quota entries in place.\n"),
+	      changed_cnt, compared_cnt, _(type2name(type)));
+out:
+	if (end_io(h) < 0) {
+		errstr(_("Cannot finish IO on quotafile: %s\n"), strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Dump the quota info that we have in memory now to the appropriate
+ * quota file. As quotafiles doesn't account to quotas we don't have to
+ * bother about accounting new blocks for quota file. Project quotas are
+ * stored in hidden system files so we just tell the kernel about new usage.
+ * The same is done for quota files used by the kernel unless they need
+ * to be rebuilt.
+ */
+static int dump_to_file(struct mount_entry *mnt, int type)
+{
+	struct dquot *dquot, **sorted;
+	uint i, cnt;
+	struct quota_handle *h;
+	int qfmt = type == PRJQUOTA ? QF_META : cfmt;
+
+	progress_phase(PHASE_DUMP);
+	/* Kernel keeps quota of GFS2, XFS and in system files, just update it */
+	if (qfmt == QF_XFS || qfmt == QF_META)
+		return commit_in_place(mnt, type, qfmt);
+	/*
+	 * If quota is turned on and the file is sane, update usage through
+	 * the kernel instead of turning quotas off and renaming new file.
+	 */
+	if (flags & FL_INPLACE || (!(flags & FL_BACKUPS) && kern_quota_on(mnt, type, cfmt) >= 0)) {
+		if (inplace_ok[type])
+			return commit_in_place(mnt, type, cfmt);
+		debug(FL_DEBUG | FL_VERBOSE, _("Cannot update %s quota file in place, writing new one.\n"),
+		      _(type2name(type)));
+	}
+	debug(FL_DEBUG, _("Dumping gathered data for %ss.\n"), _(type2name(type)));
+	if (!(h = new_io(mnt, type, cfmt))) {
+		errstr(_("Cannot initialize IO on new quotafile: %s\n"),
+		       strerror(errno));
+		return -1;
+	}
+	if (!(flags & FL_NEWFILE)) {
+		h->qh_info.dqi_bgrace = old_info[type].dqi_bgrace;
+		h->qh_info.dqi_igrace = old_info[type].dqi_igrace;
+		if (is_tree_qfmt(cfmt))
+			v2_merge_info(&h->qh_info, old_info + type);
+		mark_quotafile_info_dirty(h);
+	}
+	/*
+	 * Commit dquots in the order of ids so that quota tree blocks are
+	 * written with good locality.
+	 */
+	sorted = sorted_dquots(type, &cnt);
+	if (h->qh_ops->commit_dquots) {
+		/* New quota file can be written at once */
+		for (i = 0; i < cnt; i++) {
+			sorted[i]->dq_h = h;
+			update_grace_times(sorted[i]);
+		}
+		if (h->qh_ops->commit_dquots(h, sorted, cnt) < 0) {
+			errstr(_("Cannot write new quotafile: %s\n"), strerror(errno));
+			free(sorted);
+			end_io(h);
+			return -1;
+		}
+		cnt = 0;
+	}
+	for (i = 0; i < cnt; i++) {
+		dquot = sorted[i];
+		dquot->dq_h = h;
+		update_grace_times(dquot);
+		h->qh_ops->commit_dquot(dquot, COMMIT_ALL);
+	}
+	free(sorted);
+	if (end_io(h) < 0) {
+		errstr(_("Cannot finish IO on new quotafile: %s\n"), strerror(errno));
+		return -1;
+	}
+	debug(FL_DEBUG, _("Data dumped.\n"));
+	progress_phase(PHASE_RENAME);
+	if (kern_quota_on(mnt, type, cfmt) >= 0) {	/* Quota turned on? */
+		char *filename;
+
+		if (get_qf_name(mnt, type, cfmt, NF_FORMAT, &filename) < 0)
+			errstr(_("Cannot find checked quota file for %ss on %s!\n"), _(type2name(type)), mnt->me_devname);
+		else {
+			if (quotactl_mnt(Q_QUOTAOFF, type, mnt, 0, NULL) < 0)
+				errstr(_("Cannot turn %s quotas off on %s: %s\nKernel won't know about changes quotacheck did.\n"),
+					_(type2name(type)), mnt->me_devname, strerror(errno));
+			else {
+				int ret;
+
+				/* Rename files - if it fails we cannot do anything better than just turn on quotas again */
+				rename_files(mnt, type);
+
+				ret = quotactl_mnt(Q_QUOTAON, type, mnt, util2kernfmt(cfmt), filename);
+				if (ret < 0)
+					errstr(_("Cannot turn %s quotas on on %s: %s\nKernel won't know about changes quotacheck did.\n"),
+						_(type2name(type)), mnt->me_devname, strerror(errno));
+			}
+			free(filename);
+		}
+	}
+	else
+		if (rename_files(mnt, type) < 0)
+		        return -1;
+	return 0;
+}
+
+#ifdef HAVE_FANOTIFY
+/*
+ * Online check. While the filesystem is scanned, we watch it using fanotify
+ * and remember inodes which changed. After the scan, usage of changed inodes
+ * is fixed: what they were counted to is subtracted and their current state
+ * is added instead.
+ */
+
+/* Types of file handles we know to decode (from linux/exportfs.h) */
+#define FILEID_INO32_GEN 1
+#define FILEID_INO32_GEN_PARENT 2
+#define FILEID_INO64_GEN 0x81
+#define FILEID_INO64_GEN_PARENT 0x82
+#define FILEID_BTRFS_WITHOUT_PARENT 0x4d
+#define FILEID_BTRFS_WITH_PARENT 0x4e
+#define FILEID_BTRFS_WITH_PARENT_ROOT 0x4f
+
+static struct {
+	int fd;				/* fanotify descriptor */
+	int mntfd;			/* Mountpoint for open_by_handle_at() */
+	pthread_t thread;		/* Thread reading events during scan */
+	int stop;			/* Should the thread stop? */
+	struct online_change *table;	/* Open addressed hashtable of changed inodes */
+	uint size, used;
+	uint lost;			/* Number of changes we failed to track */
+	int overflow;			/* Did we lose events? */
+} online = { .fd = -1, .mntfd = -1 };
+
+/* Get inode number from file handle without opening it (it may be deleted) */
+static int handle_ino(struct file_handle *fh, ino_t *i_num)
+{
+	uint32_t ino32;
+	uint64_t ino64;
+
+	switch (fh->handle_type) {
+	case FILEID_INO32_GEN:
+	case FILEID_INO32_GEN_PARENT:
+		if (fh->handle_bytes < sizeof(ino32))
+			return -1;
+		memcpy(&ino32, fh->f_handle, sizeof(ino32));
+		*i_num = ino32;
+		return 0;
+	case FILEID_INO64_GEN:
+	case FILEID_INO64_GEN_PARENT:
+	case FILEID_BTRFS_WITHOUT_PARENT:
+	case FILEID_BTRFS_WITH_PARENT:
+	case FILEID_BTRFS_WITH_PARENT_ROOT:
+		if (fh->handle_bytes < sizeof(ino64))
+			return -1;
+		memcpy(&ino64, fh->f_handle, sizeof(ino64));
+		*i_num = ino64;
+		return 0;
+	}
+	return -1;
+}
+
+static void online_changes_resize(uint size)
+{
+	struct online_change *old = online.table;
+	uint oldsize = online.size, i, pos;
+
+	online.table = xmalloc(sizeof(struct online_change) * size);
+	online.size = size;
+	for (i = 0; i < oldsize; i++) {
+		if (!old[i].i_num)
+			continue;
+		for (pos = hash_ino(old[i].i_num) & (size - 1); online.table[pos].i_num;
+		     pos = (pos + 1) & (size - 1));
+		online.table[pos] = old[i];
+	}
+	free(old);
+}
+
+/* Remember that inode with given handle changed */
+static void online_note_change(struct file_handle *fh)
+{
+	struct stat st;
+	ino_t i_num;
+	uint pos;
+	int fd;
+
+	if (handle_ino(fh, &i_num) < 0) {
+		/* Unknown handle type, the inode has to exist to find its number */
+		fd = open_by_handle_at(online.mntfd, fh, O_PATH);
+		if (fd < 0 || fstat(fd, &st) < 0) {
+			online.lost++;
+			if (fd >= 0)
+				close(fd);
+			return;
+		}
+		close(fd);
+		i_num = st.st_ino;
+	}
+	if (!online.size)
+		online_changes_resize(LINKSHARD_MINSIZE);
+	else if (online.used + 1 > online.size / 2)
+		online_changes_resize(online.size * 2);
+	for (pos = hash_ino(i_num) & (online.size - 1); online.table[pos].i_num;
+	     pos = (pos + 1) & (online.size - 1))
+		if (online.table[pos].i_num == i_num)
+			break;
+	if (!online.table[pos].i_num) {
+		debug(FL_DEBUG, _("Inode %llu changed during scan\n"), (unsigned long long)i_num);
+		online.table[pos].i_num = i_num;
+		online.used++;
+	}
+	else {
+		/*
+		 * The inode number could have been reused by a new inode.
+		 * Keep the newest handle so that we find the current inode.
+		 */
+		if (online.table[pos].fh->handle_type == fh->handle_type &&
+		    online.table[pos].fh->handle_bytes == fh->handle_bytes &&
+		    !memcmp(online.table[pos].fh->f_handle, fh->f_handle, fh->handle_bytes))
+			return;
+		free(online.table[pos].fh);
+	}
+	online.table[pos].fh = xmalloc(sizeof(struct file_handle) + fh->handle_bytes);
+	memcpy(online.table[pos].fh, fh, sizeof(struct file_handle) + fh->handle_bytes);
+}
+
+/* Read all queued events */
+static void online_read_events(void)
+{
+	char buf[ONLINE_EVENT_BUF] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+	struct fanotify_event_metadata *ev;
+	struct fanotify_event_info_header *info;
+	struct fanotify_event_info_fid *fid;
+	ssize_t len;
+
+	while ((len = read(online.fd, buf, sizeof(buf))) > 0) {
+		for (ev = (struct fanotify_event_metadata *)buf; FAN_EVENT_OK(ev, len);
+		     ev = FAN_EVENT_NEXT(ev, len)) {
+			if (ev->mask & FAN_Q_OVERFLOW) {
+				online.overflow = 1;
+				continue;
+			}
+			/*
+			 * Both the changed inode and the directory (whose size can
+			 * change when entries are added) are interesting
+			 */
+			for (info = (struct fanotify_event_info_header *)(ev + 1);
+			     (char *)info < (char *)ev + ev->event_len;
+			     info = (struct fanotify_event_info_header *)((char *)info + info->len)) {
+				if (info->info_type != FAN_EVENT_INFO_TYPE_FID &&
+				    info->info_type != FAN_EVENT_INFO_TYPE_DFID &&
+				    info->info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+					continue;
+				fid = (struct fanotify_event_info_fid *)info;
+				online_note_change((struct file_handle *)fid->handle);
+			}
+		}
+	}
+	if (len < 0 && errno != EAGAIN)
+		errstr(_("Cannot read filesystem change events: %s\n"), strerror(errno));
+}
+
+static void *online_watch(void *arg)
+{
+	struct pollfd pfd = { .fd = online.fd, .events = POLLIN };
+
+	while (!__atomic_load_n(&online.stop, __ATOMIC_SEQ_CST)) {
+		if (poll(&pfd, 1, ONLINE_POLL_MS) > 0)
+			online_read_events();
+	}
+	return NULL;
+}
+
+/* Start watching changes of the filesystem */
+static int online_start(struct mount_entry *mnt)
+{
+	int i;
+
+	online.fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME_TARGET |
+				  FAN_UNLIMITED_QUEUE | FAN_NONBLOCK | FAN_CLOEXEC,
+				  O_RDONLY | O_LARGEFILE);
+	if (online.fd < 0) {
+		errstr(_("Cannot watch changes of filesystem %s: %s\n"), mnt->me_dir, strerror(errno));
+		return -1;
+	}
+	if (fanotify_mark(online.fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			  FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO |
+			  FAN_ATTRIB | FAN_MODIFY | FAN_ONDIR, AT_FDCWD, mnt->me_dir) < 0 ||
+	    (online.mntfd = open(mnt->me_dir, O_RDONLY | O_DIRECTORY)) < 0) {
+		errstr(_("Cannot watch changes of filesystem %s: %s\n"), mnt->me_dir, strerror(errno));
+		close(online.fd);
+		online.fd = -1;
+		return -1;
 	}
-#endif
-	free(filename);
+	for (i = 0; i < LINKSHARDS; i++)
+		pthread_mutex_init(&online_hash[i].lock, NULL);
+	online.stop = 0;
+	online.lost = 0;
+	online.overflow = 0;
+	if ((i = pthread_create(&online.thread, NULL, online_watch, NULL)))
+		die(2, _("Cannot create thread: %s\n"), strerror(i));
 	return 0;
 }
 
-/*
- * Dump the quota info that we have in memory now to the appropriate
- * quota file. As quotafiles doesn't account to quotas we don't have to
- * bother about accounting new blocks for quota file
- */
-static int dump_to_file(struct mount_entry *mnt, int type)
+/* Add or subtract usage of one inode */
+static void online_account(uid_t uid, gid_t gid, qid_t prjid, loff_t space, int sign)
 {
+	qid_t wanted[MAXQUOTAS] = { uid, gid, prjid };
+	int check[MAXQUOTAS] = { ucheck, gcheck, pcheck };
 	struct dquot *dquot;
-	uint i;
-	struct quota_handle *h;
-	unsigned int commit = 0;
+	int type;
 
-	debug(FL_DEBUG, _("Dumping gathered data for %ss.\n"), _(type2name(type)));
-	if (cfmt == QF_XFS) {
-		if (!(h = init_io(mnt, type, cfmt, IOI_READONLY))) {
-			errstr(_("Cannot initialize IO on xfs/gfs2 quotafile: %s\n"),
-			       strerror(errno));
-			return -1;
-		}
-	} else {
-		if (!(h = new_io(mnt, type, cfmt))) {
-			errstr(_("Cannot initialize IO on new quotafile: %s\n"),
-			       strerror(errno));
-			return -1;
-		}
-		if (!(flags & FL_NEWFILE)) {
-			h->qh_info.dqi_bgrace = old_info[type].dqi_bgrace;
-			h->qh_info.dqi_igrace = old_info[type].dqi_igrace;
-			if (is_tree_qfmt(cfmt))
-				v2_merge_info(&h->qh_info, old_info + type);
-			mark_quotafile_info_dirty(h);
-		}
-	}
-	for (i = 0; i < DQUOTHASHSIZE; i++)
-		for (dquot = dquot_hash[type][i]; dquot; dquot = dquot->dq_next) {
-			dquot->dq_h = h;
-			/* For XFS/GFS2, we don't bother with actually checking
-			 * what the usage value is in the internal quota file.
-			 * We simply attempt to update the usage for every quota
-			 * we find in the fs scan. The filesystem decides in the
-			 * quotactl handler whether to update the usage in the 
-			 * quota file or not.
-			 */
-			commit = cfmt == QF_XFS ? COMMIT_USAGE : COMMIT_ALL;
-			update_grace_times(dquot);
-			h->qh_ops->commit_dquot(dquot, commit);
-		}
-	if (end_io(h) < 0) {
-		errstr(_("Cannot finish IO on new quotafile: %s\n"), strerror(errno));
-		return -1;
+	for (type = 0; type < MAXQUOTAS; type++) {
+		if (!check[type])
+			continue;
+		if ((dquot = find_dquot(&dquot_hash[type], wanted[type])) == NODQUOT)
+			dquot = insert_dquot(&dquot_hash[type], &dquot_arena, wanted[type], type);
+		dquot->dq_dqb.dqb_curinodes += sign;
+		dquot->dq_dqb.dqb_curspace += sign * space;
 	}
-	debug(FL_DEBUG, _("Data dumped.\n"));
-	/* Moving of quota files doesn't apply to GFS2 or XFS */
-	if (cfmt == QF_XFS)
-		return 0;
-	if (kern_quota_on(mnt, type, cfmt) >= 0) {	/* Quota turned on? */
-		char *filename;
-
-		if (get_qf_name(mnt, type, cfmt, NF_FORMAT, &filename) < 0)
-			errstr(_("Cannot find checked quota file for %ss on %s!\n"), _(type2name(type)), mnt->me_devname);
-		else {
-			if (quotactl_mnt(Q_QUOTAOFF, type, mnt, 0, NULL) < 0)
-				errstr(_("Cannot turn %s quotas off on %s: %s\nKernel won't know about changes quotacheck did.\n"),
-					_(type2name(type)), mnt->me_devname, strerror(errno));
-			else {
-				int ret;
-
-				/* Rename files - if it fails we cannot do anything better than just turn on quotas again */
-				rename_files(mnt, type);
+}
 
-				ret = quotactl_mnt(Q_QUOTAON, type, mnt, util2kernfmt(cfmt), filename);
-				if (ret < 0)
-					errstr(_("Cannot turn %s quotas on on %s: %s\nKernel won't know about changes quotacheck did.\n"),
-						_(type2name(type)), mnt->me_devname, strerror(errno));
-			}
-			free(filename);
-		}
+/* Fix usage of one changed inode */
+static int online_fix(struct online_change *ch)
+{
+	struct online_inode *oi = online_find(ch->i_num);
+	struct stat st;
+	char path[64];
+	qid_t projid;
+	int fd, ret = 0;
+
+	if (oi)
+		online_account(oi->uid, oi->gid, oi->prjid, oi->space, -1);
+	fd = open_by_handle_at(online.mntfd, ch->fh, O_PATH);
+	if (fd < 0 || fstat(fd, &st) < 0 || st.st_ino != ch->i_num || !st.st_nlink) {
+		/* Inode is gone */
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	if (!oi && S_ISDIR(st.st_mode)) {
+		/*
+		 * Directory we haven't seen was moved to already scanned part
+		 * of the tree. Scan it (inodes we have seen are skipped).
+		 */
+		close(fd);
+		if ((fd = open_by_handle_at(online.mntfd, ch->fh, O_RDONLY | O_DIRECTORY)) < 0)
+			return 0;
+		sprintf(path, "/proc/self/fd/%d", fd);
+		ret = scan_dir(path);
+		close(fd);
+		return ret;
+	}
+	projid = oi ? oi->prjid : 0;
+	if (pcheck && (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+		close(fd);
+		fd = open_by_handle_at(online.mntfd, ch->fh, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+		if (fd < 0)
+			return 0;
+		sprintf(path, "inode %llu", (unsigned long long)st.st_ino);
+		if (get_fd_projid(fd, path, &projid, NULL) < 0)
+			ret = -1;
+	}
+	close(fd);
+	debug(FL_DEBUG, _("Updating usage of changed inode %llu\n"), (unsigned long long)st.st_ino);
+	online_account(st.st_uid, st.st_gid, projid, st.st_blocks << 9, 1);
+	/* Scan of a moved directory must not count the inode again */
+	if (oi) {
+		oi->uid = st.st_uid;
+		oi->gid = st.st_gid;
+		oi->prjid = projid;
+		oi->space = st.st_blocks << 9;
 	}
 	else
-		if (rename_files(mnt, type) < 0)
-		        return -1;
-	return 0;
+		online_record(st.st_ino, st.st_uid, st.st_gid, projid, st.st_blocks << 9);
+	return ret;
+}
+
+/*
+ * Stop watching the filesystem and fix usage of inodes which changed. If scan
+ * failed, just stop.
+ */
+static int online_stop(int failed)
+{
+	uint i;
+	int ret = 0;
+
+	__atomic_store_n(&online.stop, 1, __ATOMIC_SEQ_CST);
+	pthread_join(online.thread, NULL);
+	if (!failed) {
+		online_read_events();
+		debug(FL_DEBUG | FL_VERBOSE, _("%u inodes changed during scan.\n"), online.used);
+		for (i = 0; i < online.size; i++)
+			if (online.table[i].i_num && online_fix(online.table + i) < 0)
+				ret = -1;
+		if (online.overflow || online.lost)
+			errstr(_("Some changes of the filesystem during scan could not be tracked. Counted values might not be right.\n"));
+	}
+	close(online.fd);
+	close(online.mntfd);
+	online.fd = online.mntfd = -1;
+	for (i = 0; i < online.size; i++)
+		free(online.table[i].fh);
+	free(online.table);
+	online.table = NULL;
+	online.size = online.used = 0;
+	for (i = 0; i < LINKSHARDS; i++)
+		pthread_mutex_destroy(&online_hash[i].lock);
+	return ret;
 }
+#endif
 
 /* Substract space used by old quota file from usage.
  * Return non-zero in case of failure, zero otherwise. */
@@ -896,7 +3194,7 @@ static int sub_quota_file(struct mount_entry *mnt, int qtype, int ftype)
 		free(filename);
 		return 0;
 	}
-	qspace = getqsize(filename, &st);
+	qspace = getqsize(AT_FDCWD, filename, &st);
 	free(filename);
 	
 	if (qtype == USRQUOTA)
@@ -927,7 +3225,9 @@ static int check_dir(struct mount_entry *mnt)
 	if (!S_ISDIR(st.st_mode))
 		die(2, _("Mountpoint %s is not a directory?!\n"), mnt->me_dir);
 	cur_dev = st.st_dev;
+	qsize_ioctl = fs_needs_qsize_ioctl(mnt->me_type);
 	files_done = dirs_done = 0;
+	progress_start(mnt->me_dir);
 	/*
 	 * For gfs2, we scan the fs first and then tell the kernel about the new usage.
 	 * So, there's no need to load any information. We also don't remount the
@@ -938,6 +3238,7 @@ static int check_dir(struct mount_entry *mnt)
 		goto start_scan;
 	if (ucheck) {
 		ret = process_file(mnt, USRQUOTA);
+		inplace_ok[USRQUOTA] = ret == 0 && !(flags & FL_NEWFILE) && is_tree_qfmt(cfmt);
 		if (ret < 0) {
 			failed |= ret;
 			ucheck = 0;
@@ -945,13 +3246,14 @@ static int check_dir(struct mount_entry *mnt)
 	}
 	if (gcheck) {
 		ret = process_file(mnt, GRPQUOTA);
+		inplace_ok[GRPQUOTA] = ret == 0 && !(flags & FL_NEWFILE) && is_tree_qfmt(cfmt);
 		if (ret < 0) {
 			failed |= ret;
 			gcheck = 0;
 		}
 	}
-	if (!ucheck && !gcheck)	/* Nothing to check? */
-		return failed;
+	if (!ucheck && !gcheck && !pcheck)	/* Nothing to check? */
+		goto out;
 	if (!(flags & FL_NOREMOUNT)) {
 		/* Now we try to remount fs read-only to prevent races when scanning filesystem */
 		if (mount
@@ -977,12 +3279,42 @@ Please stop all programs writing to filesystem or use -m flag to force checking.
 		debug(FL_DEBUG, _("Filesystem remounted read-only\n"));
 	}
 start_scan:
+	progress_phase(PHASE_SCAN);
+	if (checkpoint_file) {
+		/* Checkpoint is useless if the filesystem can change under us */
+		if (fs_readonly(mnt)) {
+			struct sigaction sa;
+
+			get_fs_state(mnt, &scan_fs_state);
+			checkpointing = 1;
+			scan_interrupted = 0;
+			next_checkpoint = time(NULL) + checkpoint_interval;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = scan_interrupt;
+			sigaction(SIGINT, &sa, NULL);
+			sigaction(SIGTERM, &sa, NULL);
+		}
+		else {
+			errstr(_("Filesystem %s is not read-only, checkpoints will not be written.\n"),
+			       mnt->me_dir);
+		}
+	}
+#ifdef HAVE_FANOTIFY
+	if (flags & FL_ONLINE && online_start(mnt) < 0) {
+		failed = -1;
+		goto out;
+	}
+#endif
 	debug(FL_VERBOSE | FL_DEBUG, _("Scanning %s [%s] "), mnt->me_devname, mnt->me_dir);
 #if defined(EXT2_DIRECT)
-	if (!strcmp(mnt->me_type, MNTTYPE_EXT2) ||
+	/*
+	 * Checkpoints are supported only by the directory walker and inode
+	 * tables can't be read directly while the filesystem changes
+	 */
+	if (!checkpoint_file && !(flags & FL_ONLINE) && (!strcmp(mnt->me_type, MNTTYPE_EXT2) ||
 	    !strcmp(mnt->me_type, MNTTYPE_EXT3) ||
 	    !strcmp(mnt->me_type, MNTTYPE_NEXT3) ||
-	    !strcmp(mnt->me_type, MNTTYPE_EXT4)) {
+	    !strcmp(mnt->me_type, MNTTYPE_EXT4))) {
 		ret = ext2_direct_scan(mnt->me_devname);
 		if (ret < 0) {
 			failed |= ret;
@@ -995,7 +3327,15 @@ start_scan:
 #endif
 		if (flags & FL_VERYVERBOSE)
 			putchar('\n');
-		ret = scan_dir(mnt->me_dir);
+		if (scan_threads > 1)
+			ret = scan_dir_parallel(mnt->me_dir);
+		else
+			ret = scan_dir(mnt->me_dir);
+		if (checkpointing) {
+			checkpointing = 0;
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+		}
 		if (ret < 0) {
 			failed |= ret;
 			goto out;
@@ -1004,6 +3344,10 @@ start_scan:
 	dirs_done++;
 	if (flags & FL_VERBOSE || flags & FL_DEBUG)
 		fputs(_("done\n"), stdout);
+#ifdef HAVE_FANOTIFY
+	if (online.fd >= 0)
+		failed |= online_stop(0);
+#endif
 	if (ucheck) {
 		failed |= sub_quota_file(mnt, USRQUOTA, USRQUOTA);
 		failed |= sub_quota_file(mnt, USRQUOTA, GRPQUOTA);
@@ -1014,6 +3358,8 @@ start_scan:
 	}
 	debug(FL_DEBUG | FL_VERBOSE, _("Checked %d directories and %d files\n"), dirs_done,
 	      files_done);
+	debug(FL_DEBUG | FL_VERBOSE, _("Used %zu KB of memory for quota structures, %zu KB for hardlinks and %zu KB for directory scan\n"),
+	      dquot_arena.size >> 10, links_peak >> 10, walk_mem >> 10);
 	if (remounted) {
 		if (mount(NULL, mnt->me_dir, mnt->me_type, MS_MGC_VAL | MS_REMOUNT, NULL) < 0)
 			die(4, _("Cannot remount filesystem %s read-write. cannot write new quota files.\n"), mnt->me_dir);
@@ -1023,7 +3369,14 @@ start_scan:
 		failed |= dump_to_file(mnt, USRQUOTA);
 	if (gcheck)
 		failed |= dump_to_file(mnt, GRPQUOTA);
+	if (pcheck)
+		failed |= dump_to_file(mnt, PRJQUOTA);
 out:
+#ifdef HAVE_FANOTIFY
+	if (online.fd >= 0)
+		online_stop(1);
+#endif
+	progress_stop(failed);
 	remove_list();
 	return failed;
 }
@@ -1155,6 +3508,402 @@ static int kernel_supports_jquota(void)
 	return 1;
 }
 
+/* Save usage of the scanned directory tree */
+static int save_subtree_usage(void)
+{
+	int check[MAXQUOTAS] = { ucheck, gcheck, pcheck };
+	struct dquot **sorted;
+	uint i, cnt;
+	int type;
+	FILE *f;
+
+	f = fopen(save_usage_file, "w");
+	if (!f) {
+		errstr(_("Cannot create file %s: %s\n"), save_usage_file, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "# quotacheck usage of %s\n", subtree);
+	for (type = 0; type < MAXQUOTAS; type++) {
+		if (!check[type])
+			continue;
+		sorted = sorted_dquots(type, &cnt);
+		for (i = 0; i < cnt; i++)
+			fprintf(f, "%s %u %lld %lld\n", type2name(type), (uint)sorted[i]->dq_id,
+				(long long)sorted[i]->dq_dqb.dqb_curinodes,
+				(long long)sorted[i]->dq_dqb.dqb_curspace);
+		free(sorted);
+	}
+	if (fclose(f) == EOF) {
+		errstr(_("Cannot write file %s: %s\n"), save_usage_file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Subtract saved usage of what the scanned directory tree replaced */
+static int load_replaced_usage(void)
+{
+	int check[MAXQUOTAS] = { ucheck, gcheck, pcheck };
+	char line[256], tname[16];
+	unsigned int id;
+	long long inodes, space;
+	struct dquot *dquot;
+	int type, lineno = 0, ret = 0;
+	FILE *f;
+
+	f = fopen(replaced_file, "r");
+	if (!f) {
+		errstr(_("Cannot open file %s: %s\n"), replaced_file, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%15s %u %lld %lld", tname, &id, &inodes, &space) != 4) {
+			errstr(_("Cannot parse line %d of %s.\n"), lineno, replaced_file);
+			ret = -1;
+			break;
+		}
+		for (type = 0; type < MAXQUOTAS && strcmp(tname, type2name(type)); type++);
+		if (type == MAXQUOTAS) {
+			errstr(_("Unknown quota type %s on line %d of %s.\n"), tname, lineno, replaced_file);
+			ret = -1;
+			break;
+		}
+		if (!check[type])
+			continue;
+		if ((dquot = lookup_dquot(id, type)) == NODQUOT)
+			dquot = add_dquot(id, type);
+		dquot->dq_dqb.dqb_curinodes -= inodes;
+		dquot->dq_dqb.dqb_curspace -= space;
+	}
+	fclose(f);
+	return ret;
+}
+
+/* Add usage difference of the scanned directory tree to current usage */
+static int apply_subtree_delta(struct mount_entry *mnt, int type)
+{
+	struct quota_handle *h;
+	struct dquot **sorted, *dquot;
+	uint i, cnt;
+	int ret = 0;
+
+	h = init_io(mnt, type, type == PRJQUOTA ? QF_META : cfmt, 0);
+	if (!h) {
+		errstr(_("Cannot initialize IO on %s quota of %s: %s\n"),
+		       _(type2name(type)), mnt->me_dir, strerror(errno));
+		return -1;
+	}
+	sorted = sorted_dquots(type, &cnt);
+	for (i = 0; i < cnt; i++) {
+		if (!sorted[i]->dq_dqb.dqb_curinodes && !sorted[i]->dq_dqb.dqb_curspace)
+			continue;
+		dquot = h->qh_ops->read_dquot(h, sorted[i]->dq_id);
+		if (!dquot) {
+			errstr(_("Cannot read %s quota for id %u: %s\n"), _(type2name(type)),
+			       (uint)sorted[i]->dq_id, strerror(errno));
+			ret = -1;
+			continue;
+		}
+		debug(FL_DEBUG, _("Changing usage of %s %u by %lld inodes and %lld bytes\n"),
+		      _(type2name(type)), (uint)dquot->dq_id,
+		      (long long)sorted[i]->dq_dqb.dqb_curinodes,
+		      (long long)sorted[i]->dq_dqb.dqb_curspace);
+		dquot->dq_dqb.dqb_curinodes += sorted[i]->dq_dqb.dqb_curinodes;
+		if (dquot->dq_dqb.dqb_curinodes < 0)
+			dquot->dq_dqb.dqb_curinodes = 0;
+		dquot->dq_dqb.dqb_curspace += sorted[i]->dq_dqb.dqb_curspace;
+		if (dquot->dq_dqb.dqb_curspace < 0)
+			dquot->dq_dqb.dqb_curspace = 0;
+		update_grace_times(dquot);
+		if (h->qh_ops->commit_dquot(dquot, COMMIT_USAGE | COMMIT_TIMES) < 0) {
+			errstr(_("Cannot write %s quota for id %u: %s\n"), _(type2name(type)),
+			       (uint)dquot->dq_id, strerror(errno));
+			ret = -1;
+		}
+		free(dquot);
+	}
+	free(sorted);
+	if (end_io(h) < 0) {
+		errstr(_("Cannot finish IO on %s quota of %s: %s\n"),
+		       _(type2name(type)), mnt->me_dir, strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Recount usage of a directory tree. Either save the usage to a file or
+ * add the difference against usage of what the tree replaced to current
+ * usage. The filesystem is not remounted so the caller has to make sure
+ * nobody modifies the tree while we scan it.
+ */
+static int check_subtree(struct mount_entry *mnt)
+{
+	struct stat st;
+	int failed = 0;
+
+	if (cfmt == QF_XFS) {
+		errstr(_("Usage cannot be changed on XFS or GFS2 filesystem %s.\n"), mnt->me_dir);
+		return -1;
+	}
+	if (lstat(subtree, &st) < 0) {
+		errstr(_("Cannot stat directory %s: %s\n"), subtree, strerror(errno));
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode) || st.st_dev != mnt->me_dev) {
+		errstr(_("%s is not a directory on filesystem %s.\n"), subtree, mnt->me_dir);
+		return -1;
+	}
+	cur_dev = st.st_dev;
+	qsize_ioctl = fs_needs_qsize_ioctl(mnt->me_type);
+	files_done = dirs_done = 0;
+	debug(FL_VERBOSE | FL_DEBUG, _("Scanning %s "), subtree);
+	if (flags & FL_VERYVERBOSE)
+		putchar('\n');
+	if (scan_threads > 1)
+		failed = scan_dir_parallel(subtree);
+	else
+		failed = scan_dir(subtree);
+	if (failed < 0)
+		goto out;
+	dirs_done++;
+	if (flags & FL_VERBOSE || flags & FL_DEBUG)
+		fputs(_("done\n"), stdout);
+	debug(FL_DEBUG | FL_VERBOSE, _("Checked %d directories and %d files\n"), dirs_done,
+	      files_done);
+	if (save_usage_file) {
+		failed = save_subtree_usage();
+		goto out;
+	}
+	if (replaced_file && load_replaced_usage() < 0) {
+		failed = -1;
+		goto out;
+	}
+	if (ucheck)
+		failed |= apply_subtree_delta(mnt, USRQUOTA);
+	if (gcheck)
+		failed |= apply_subtree_delta(mnt, GRPQUOTA);
+	if (pcheck)
+		failed |= apply_subtree_delta(mnt, PRJQUOTA);
+out:
+	remove_list();
+	return failed;
+}
+
+/*
+ * Decide which quota types to check on a filesystem and in which format.
+ * Returns 1 when there's nothing to check, -1 on error.
+ */
+static int prepare_check(struct mount_entry *mnt)
+{
+	int nothing = 1;	/* What to return when there's nothing to check */
+
+	if (flags & FL_ALL && flags & FL_NOROOT && !strcmp(mnt->me_dir, "/"))
+		return 1;
+	if (!compatible_fs_qfmt(mnt->me_type, fmt)) {
+		debug(FL_DEBUG | FL_VERBOSE, _("Skipping %s [%s]\n"), mnt->me_devname, mnt->me_dir);
+		return 1;
+	}
+	cfmt = fmt;
+	if (uwant && me_hasquota(mnt, USRQUOTA) && mnt->me_qfmt[USRQUOTA] != QF_META)
+		ucheck = 1;
+	else
+		ucheck = 0;
+	if (gwant && me_hasquota(mnt, GRPQUOTA) && mnt->me_qfmt[GRPQUOTA] != QF_META)
+		gcheck = 1;
+	else
+		gcheck = 0;
+	/* Project quotas are checked only when stored in system files */
+	pcheck = 0;
+	if (pwant && me_hasquota(mnt, PRJQUOTA)) {
+		if (mnt->me_qfmt[PRJQUOTA] == QF_META)
+			pcheck = 1;
+		else {
+			errstr(_("Project quota on %s is not stored in system files, cannot check it.\n"),
+			       mnt->me_dir);
+			nothing = -1;
+		}
+	}
+	if (!ucheck && !gcheck && !pcheck)
+		return nothing;
+	if (!ucheck && !gcheck) {
+		cfmt = QF_META;
+	}
+	else if (cfmt == -1) {
+		cfmt = detect_filename_format(mnt, ucheck ? USRQUOTA : GRPQUOTA);
+		if (cfmt == -1) {
+			errstr(_("Cannot guess format from filename on %s. Please specify format on commandline.\n"),
+				mnt->me_devname);
+			return -1;
+		}
+		debug(FL_DEBUG, _("Detected quota format %s\n"), fmt2name(cfmt));
+	}
+	return 0;
+}
+
+/*
+ * Filesystems on one device checked by one process. Output of the process
+ * is captured and printed once the check is finished so that output of
+ * parallel checks does not get mixed.
+ */
+struct check_job {
+	dev_t disk;			/* Device (whole disk) filesystems are on */
+	struct mount_entry **mnts;	/* Filesystems to check */
+	int mnts_cnt;
+	pid_t pid;			/* Process doing the check */
+	FILE *out, *err;		/* Captured stdout and stderr */
+	int done;
+	int failed;
+};
+
+static struct check_job *check_jobs_list;
+static int check_jobs_cnt;
+
+/*
+ * Find device filesystem is on. Partitions of one disk are considered to be
+ * the same device as there's no point in checking them in parallel.
+ */
+static dev_t mount_disk(struct mount_entry *mnt)
+{
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned int maj, min;
+	FILE *f;
+	int ret;
+
+	if (stat(mnt->me_devname, &st) < 0 || !S_ISBLK(st.st_mode))
+		return mnt->me_dev;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (access(path, F_OK) < 0)
+		return st.st_rdev;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		 major(st.st_rdev), minor(st.st_rdev));
+	f = fopen(path, "r");
+	if (!f)
+		return st.st_rdev;
+	ret = fscanf(f, "%u:%u", &maj, &min);
+	fclose(f);
+	if (ret != 2)
+		return st.st_rdev;
+	return makedev(maj, min);
+}
+
+/* Queue filesystem for check by a job of its device */
+static void add_check_job(struct mount_entry *mnt)
+{
+	dev_t disk = mount_disk(mnt);
+	struct check_job *job;
+	int i;
+
+	for (i = 0; i < check_jobs_cnt && check_jobs_list[i].disk != disk; i++);
+	if (i == check_jobs_cnt) {
+		check_jobs_list = srealloc(check_jobs_list, sizeof(struct check_job) * (check_jobs_cnt + 1));
+		job = &check_jobs_list[check_jobs_cnt++];
+		memset(job, 0, sizeof(*job));
+		job->disk = disk;
+	}
+	job = &check_jobs_list[i];
+	job->mnts = srealloc(job->mnts, sizeof(struct mount_entry *) * (job->mnts_cnt + 1));
+	job->mnts[job->mnts_cnt++] = mnt;
+}
+
+/* Start process checking filesystems of a job */
+static int start_check_job(struct check_job *job)
+{
+	int i, failed = 0;
+
+	if (!(job->out = tmpfile()) || !(job->err = tmpfile())) {
+		errstr(_("Cannot create temporary file: %s\n"), strerror(errno));
+		return -1;
+	}
+	fflush(stdout);
+	fflush(stderr);
+	job->pid = fork();
+	if (job->pid < 0) {
+		errstr(_("Cannot fork: %s\n"), strerror(errno));
+		return -1;
+	}
+	if (job->pid)
+		return 0;
+
+	if (dup2(fileno(job->out), STDOUT_FILENO) < 0 || dup2(fileno(job->err), STDERR_FILENO) < 0)
+		exit(EXIT_FAILURE);
+	for (i = 0; i < job->mnts_cnt; i++) {
+		if (prepare_check(job->mnts[i]) < 0) {
+			failed = -1;
+			continue;
+		}
+		failed |= check_dir(job->mnts[i]);
+	}
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/* Copy captured output of a job to our output */
+static void print_check_job(struct check_job *job)
+{
+	char buf[4096];
+	size_t len;
+
+	fflush(stdout);
+	fflush(stderr);
+	rewind(job->out);
+	while ((len = fread(buf, 1, sizeof(buf), job->out)) > 0)
+		fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+	rewind(job->err);
+	while ((len = fread(buf, 1, sizeof(buf), job->err)) > 0)
+		fwrite(buf, 1, len, stderr);
+	fclose(job->out);
+	fclose(job->err);
+	free(job->mnts);
+}
+
+/*
+ * Check queued filesystems, at most check_jobs devices at once. Output is
+ * printed in the order of filesystems in the mount table.
+ */
+static int run_check_jobs(void)
+{
+	int started = 0, running = 0, printed = 0, failed = 0;
+	int i, status;
+	pid_t pid;
+
+	while (printed < check_jobs_cnt) {
+		while (running < check_jobs && started < check_jobs_cnt) {
+			if (start_check_job(&check_jobs_list[started]) < 0)
+				die(2, _("Cannot start check of %s.\n"),
+				    check_jobs_list[started].mnts[0]->me_devname);
+			started++;
+			running++;
+		}
+		pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			die(2, _("Cannot wait for check to finish: %s\n"), strerror(errno));
+		}
+		for (i = 0; i < started && check_jobs_list[i].pid != pid; i++);
+		if (i == started)
+			continue;
+		running--;
+		check_jobs_list[i].done = 1;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			check_jobs_list[i].failed = -1;
+		for (; printed < started && check_jobs_list[printed].done; printed++) {
+			print_check_job(&check_jobs_list[printed]);
+			failed |= check_jobs_list[printed].failed;
+		}
+	}
+	free(check_jobs_list);
+	check_jobs_list = NULL;
+	check_jobs_cnt = 0;
+	return failed;
+}
+
 /* Return 0 in case of success, non-zero otherwise. */
 static int check_all(void)
 {
@@ -1162,39 +3911,18 @@ static int check_all(void)
 	int checked = 0;
 	static int warned;
 	int failed = 0;
+	int ret;
 
 	if (init_mounts_scan((flags & FL_ALL) ? 0 : 1, &mntpoint, 0) < 0)
 		die(2, _("Cannot initialize mountpoint scan.\n"));
 	while ((mnt = get_next_mount())) {
-		if (flags & FL_ALL && flags & FL_NOROOT && !strcmp(mnt->me_dir, "/"))
-			continue;
-		if (!compatible_fs_qfmt(mnt->me_type, fmt)) {
-			debug(FL_DEBUG | FL_VERBOSE, _("Skipping %s [%s]\n"), mnt->me_devname, mnt->me_dir);
-			continue;
-		}
-		cfmt = fmt;
-		if (uwant && me_hasquota(mnt, USRQUOTA) && mnt->me_qfmt[USRQUOTA] != QF_META)
-			ucheck = 1;
-		else
-			ucheck = 0;
-		if (gwant && me_hasquota(mnt, GRPQUOTA) && mnt->me_qfmt[GRPQUOTA] != QF_META)
-			gcheck = 1;
-		else
-			gcheck = 0;
-		if (!ucheck && !gcheck)
+		ret = prepare_check(mnt);
+		if (ret < 0)
+			failed = -1;
+		if (ret)
 			continue;
-		if (cfmt == -1) {
-			cfmt = detect_filename_format(mnt, ucheck ? USRQUOTA : GRPQUOTA);
-			if (cfmt == -1) {
-				errstr(_("Cannot guess format from filename on %s. Please specify format on commandline.\n"),
-					mnt->me_devname);
-				failed = -1;
-				continue;
-			}
-			debug(FL_DEBUG, _("Detected quota format %s\n"), fmt2name(cfmt));
-		}
 
-		if (!warned) {
+		if (!warned && (ucheck || gcheck)) {
 			if (!strcmp(mnt->me_type, MNTTYPE_EXT4) &&
 			    ext4_supports_quota_feature()) {
 				warned = 1;
@@ -1225,8 +3953,15 @@ static int check_all(void)
 		}
 
 		checked++;
-		failed |= check_dir(mnt);
+		if (subtree)
+			failed |= check_subtree(mnt);
+		else if (check_jobs > 1)
+			add_check_job(mnt);
+		else
+			failed |= check_dir(mnt);
 	}
+	if (check_jobs > 1)
+		failed |= run_check_jobs();
 	end_mounts_scan();
 	if (!checked && (!(flags & FL_ALL) || flags & (FL_VERBOSE | FL_DEBUG))) {
 		errstr(_("Cannot find filesystem to check or filesystem not mounted with quota option.\n"));
@@ -1246,9 +3981,5 @@ int main(int argc, char **argv)
 	init_kernel_interface();
 
 	failed = check_all();
-#ifdef DEBUG_MALLOC
-	errstr(_("Allocated %d bytes memory\nFree'd %d bytes\nLost %d bytes\n"),
-		malloc_mem, free_mem, malloc_mem - free_mem);
-#endif
 	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
@@ -26,15 +26,13 @@
 #define FL_NOROOT 512		/* Scan all mountpoints except root */
 #define FL_BACKUPS 1024		/* Create backup of old quota file? */
 #define FL_VERYVERBOSE 2048	/* Print directory names when checking */
+#define FL_SORTINODES 4096	/* Stat directory entries in order of inode numbers */
+#define FL_INPLACE 8192		/* Update changed entries in existing quota file */
+#define FL_ONLINE 16384		/* Track changes of filesystem during scan */
 
 extern int flags;		/* Options from command line */
 extern struct util_dqinfo old_info[MAXQUOTAS];	/* Loaded info from file */
 
-#ifdef DEBUG_MALLOC
-extern size_t malloc_mem = 0;
-extern size_t free_mem = 0;
-#endif
-
 void *xmalloc(size_t size);
 void debug(int df, char *fmtstr, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
 int ask_yn(char *q, int def);
@@ -44,13 +44,13 @@ static int check_blkref(uint blk, uint blocks)
 	return 0;
 }
 
-/* Load and check basic info about quotas */
+/* Load and check basic info about quotas, return 1 if info had to be fixed up */
 static int check_info(char *filename, int fd, int type)
 {
 	struct v2_disk_dqinfo dinfo;
 	uint blocks, dflags, freeblk, freeent;
 	off_t filesize;
-	int err;
+	int err, ret = 0;
 
 	debug(FL_DEBUG, _("Checking quotafile info...\n"));
 	lseek(fd, V2_DQINFOOFF, SEEK_SET);
@@ -84,6 +84,7 @@ static int check_info(char *filename, int fd, int type)
 		old_info[type].u.v2_mdqi.dqi_flags = 0;
 		printf(_("Setting grace times and other flags to default values.\nAssuming number of blocks is %u.\n"),
 		       old_info[type].u.v2_mdqi.dqi_qtree.dqi_blocks);
+		ret = 1;
 	}
 	else {
 		old_info[type].dqi_bgrace = le32toh(dinfo.dqi_bgrace);
@@ -100,7 +101,7 @@ static int check_info(char *filename, int fd, int type)
 	old_info[type].u.v2_mdqi.dqi_qtree.dqi_free_entry = 0;
 
 	debug(FL_DEBUG, _("File info done.\n"));
-	return 0;
+	return ret;
 }
 
 /* Print errstr message */
@@ -377,12 +378,15 @@ static int check_header(char *filename, int fd, int type, int version)
 	return 0;
 }
 
-/* Load data from file to memory */
+/*
+ * Load data from file to memory. Returns 1 if the file was damaged and
+ * so it must be rewritten as a whole.
+ */
 int v2_buffer_file(char *filename, int fd, int type, int fmt)
 {
 	uint blocks, lastblk = 0;
 	int corrupted = 0, ret = 0;
-	int version;
+	int version, damaged;
 
 	if (fmt == QF_VFSV0)
 		version = 0;
@@ -397,7 +401,8 @@ int v2_buffer_file(char *filename, int fd, int type, int fmt)
 		return 0;
 	if (check_header(filename, fd, type, version) < 0)
 		return -1;
-	if (check_info(filename, fd, type) < 0)
+	damaged = check_info(filename, fd, type);
+	if (damaged < 0)
 		return -1;
 	debug(FL_DEBUG, _("Headers of file %s checked. Going to load data...\n"),
 	      filename);
@@ -406,11 +411,10 @@ int v2_buffer_file(char *filename, int fd, int type, int fmt)
 	memset(blkbmp, 0, (blocks + 7) >> 3);
 	if (check_tree_ref(0, QT_TREEOFF, blocks, 1, &corrupted, &lastblk) >= 0)
 		ret = check_tree_blk(fd, QT_TREEOFF, 0, type, blocks, &corrupted, &lastblk);
-	else
+	else {
 		errstr(_("Cannot gather quota data. Tree root node corrupted.\n"));
-#ifdef DEBUG_MALLOC
-	free_mem += (blocks + 7) >> 3;
-#endif
+		damaged = 1;
+	}
 	free(blkbmp);
 	if (corrupted) {
 		if (!(flags & (FL_VERBOSE | FL_DEBUG)))
@@ -419,6 +423,8 @@ int v2_buffer_file(char *filename, int fd, int type, int fmt)
 	}
 	else
 		debug(FL_DEBUG, _("Not found any corrupted blocks. Congratulations.\n"));
+	if (ret >= 0 && (corrupted || damaged))
+		ret = 1;
 	return ret;
 }
 
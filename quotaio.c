@@ -15,6 +15,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <endian.h>
 
 #include "pot.h"
@@ -22,6 +23,7 @@
 #include "common.h"
 #include "quotasys.h"
 #include "quotaio.h"
+#include "quotaio_generic.h"
 
 #include "dqblk_v1.h"
 #include "dqblk_v2.h"
@@ -51,6 +53,25 @@ int quotactl_handle(int cmd, struct quota_handle *h, int id, void *addr)
 
 	return err;
 }
+/*
+ *	Map quotafile opened for reading so that formats can access it without
+ *	copying. When mapping fails, formats just read the file.
+ */
+static void map_quotafile(struct quota_handle *h)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(h->qh_fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size ||
+	    (uint64_t)st.st_size > SIZE_MAX)
+		return;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, h->qh_fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	h->qh_map = map;
+	h->qh_map_len = st.st_size;
+}
+
 /*
  *	Detect quota format and initialize quota IO
  */
@@ -66,6 +87,9 @@ struct quota_handle *init_io(struct mount_entry *mnt, int type, int fmt, int fla
 	if (stat(mnt->me_devname, &h->qh_stat) < 0)
 		memset(&h->qh_stat, 0, sizeof(struct stat));
 	h->qh_io_flags = 0;
+	h->qh_cache = NULL;
+	h->qh_map = NULL;
+	h->qh_scan_ctx = NULL;
 	if (flags & IOI_READONLY)
 		h->qh_io_flags |= IOFL_RO;
 	if (flags & IOI_NFS_MIXED_PATHS)
@@ -170,6 +194,8 @@ struct quota_handle *init_io(struct mount_entry *mnt, int type, int fmt, int fla
 		/* Init handle */
 		h->qh_fd = fd;
 		h->qh_fmt = fmt;
+		if (QIO_RO(h))
+			map_quotafile(h);
 	} else {
 		h->qh_fd = -1;
 		h->qh_fmt = fmt;
@@ -192,6 +218,8 @@ set_ops:
 	}
 	return h;
 out_lock:
+	if (h->qh_map)
+		munmap(h->qh_map, h->qh_map_len);
 	if (fd != -1)
 		flock(fd, LOCK_UN);
 out_handle:
@@ -242,6 +270,9 @@ struct quota_handle *new_io(struct mount_entry *mnt, int type, int fmt)
 
 	h->qh_fd = fd;
 	h->qh_io_flags = 0;
+	h->qh_cache = NULL;
+	h->qh_map = NULL;
+	h->qh_scan_ctx = NULL;
 	sstrncpy(h->qh_quotadev, mnt->me_devname, sizeof(h->qh_quotadev));
 	sstrncpy(h->qh_fstype, mnt->me_type, MAX_FSTYPE_LEN);
 	sstrncpy(h->qh_dir, mnt->me_dir, PATH_MAX);
@@ -270,6 +301,10 @@ out_fd:
  */
 int end_io(struct quota_handle *h)
 {
+	h->qh_io_flags &= ~IOFL_BATCH;
+	/* Write changed blocks first so that info never points to unwritten ones */
+	if (h->qh_ops->flush && h->qh_ops->flush(h) < 0)
+		return -1;
 	if (h->qh_io_flags & IOFL_INFODIRTY) {
 		if (h->qh_ops->write_info && h->qh_ops->write_info(h) < 0)
 			return -1;
@@ -277,6 +312,8 @@ int end_io(struct quota_handle *h)
 	}
 	if (h->qh_ops->end_io && h->qh_ops->end_io(h) < 0)
 		return -1;
+	if (h->qh_map)
+		munmap(h->qh_map, h->qh_map_len);
 	if (h->qh_fd != -1) {
 		flock(h->qh_fd, LOCK_UN);
 		close(h->qh_fd);
@@ -285,6 +322,56 @@ int end_io(struct quota_handle *h)
 	return 0;
 }
 
+/*
+ *	Start a batch of changes. Until end_batch() is called, formats may keep
+ *	changed quota structures and info in memory and write them later in a
+ *	more efficient order.
+ */
+void begin_batch(struct quota_handle *h)
+{
+	h->qh_io_flags |= IOFL_BATCH;
+}
+
+/*
+ *	Write all changes done in a batch
+ */
+int end_batch(struct quota_handle *h)
+{
+	if (!(h->qh_io_flags & IOFL_BATCH))
+		return 0;
+	h->qh_io_flags &= ~IOFL_BATCH;
+	if (h->qh_ops->flush && h->qh_ops->flush(h) < 0)
+		return -1;
+	if (h->qh_io_flags & IOFL_INFODIRTY) {
+		if (h->qh_ops->write_info && h->qh_ops->write_info(h) < 0)
+			return -1;
+		h->qh_io_flags &= ~IOFL_INFODIRTY;
+	}
+	return 0;
+}
+
+/*
+ *	Scan quota structures in batches. Formats which cannot fill batches
+ *	directly are scanned one structure at a time.
+ */
+int scan_dquots_batch(struct quota_handle *h, int (*process_batch)(struct dquot_batch *))
+{
+	if (h->qh_ops->scan_dquots_batch)
+		return h->qh_ops->scan_dquots_batch(h, process_batch);
+	return generic_scan_dquots_batch(h, process_batch);
+}
+
+/*
+ *	Read dquots for given ids. Formats can look up several ids at once
+ *	more efficiently than one by one.
+ */
+int read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots)
+{
+	if (h->qh_ops->read_dquots)
+		return h->qh_ops->read_dquots(h, ids, count, dquots);
+	return generic_read_dquots(h, ids, count, dquots);
+}
+
 /*
  *	Create empty quota structure
  */
@@ -297,6 +384,32 @@ struct dquot *get_empty_dquot(void)
 	return dquot;
 }
 
+/*
+ *	Create empty batch of quota structures
+ */
+struct dquot_batch *get_empty_dquot_batch(struct quota_handle *h)
+{
+	struct dquot_batch *b = smalloc(sizeof(struct dquot_batch));
+
+	b->db_h = h;
+	b->db_count = 0;
+	return b;
+}
+
+/*
+ *	Pass collected quota structures to the callback
+ */
+int flush_dquot_batch(struct dquot_batch *b, int (*process_batch)(struct dquot_batch *))
+{
+	int ret;
+
+	if (!b->db_count)
+		return 0;
+	ret = process_batch(b);
+	b->db_count = 0;
+	return ret;
+}
+
 /*
  *	Check whether values in current dquot can be stored on disk
  */
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "quota.h"
 #include "mntopt.h"
@@ -64,8 +65,10 @@ static inline int is_tree_qfmt(int fmt)
 #define IOFL_RO		0x04	/* Just RO access? */
 #define IOFL_NFS_MIXED_PATHS	0x08	/* Should we trim leading slashes
 					   from NFSv4 mountpoints? */
+#define IOFL_BATCH	0x10	/* Are changes being collected in a batch? */
 
 struct quotafile_ops;
+struct qtree_cache;
 
 /* Generic information about quotafile */
 struct util_dqinfo {
@@ -93,6 +96,10 @@ struct quota_handle {
 	struct stat qh_stat;	/* stat(2) for qh_quotadev */
 	struct quotafile_ops *qh_ops;	/* Operations on quotafile */
 	struct util_dqinfo qh_info;	/* Generic quotafile info */
+	struct qtree_cache *qh_cache;	/* Cached blocks of quota tree */
+	char *qh_map;		/* Read-only mapping of quotafile (or NULL) */
+	size_t qh_map_len;	/* Length of the mapping */
+	void *qh_scan_ctx;	/* Context of running scan for scan_dquots() callbacks (or NULL) */
 };
 
 /* Statistics gathered from kernel */
@@ -135,6 +142,24 @@ struct dquot {
 	struct util_dqblk dq_dqb;	/* Parsed data of dquot */
 };
 
+#define DQ_BATCH_SIZE 256	/* Number of dquots passed to scan_dquots_batch() callback at once */
+
+/* Several loaded quotas stored in parallel arrays */
+struct dquot_batch {
+	struct quota_handle *db_h;	/* Handle of quotafile dquots belong to */
+	int db_count;			/* Number of valid entries */
+	qid_t db_id[DQ_BATCH_SIZE];
+	qsize_t db_curspace[DQ_BATCH_SIZE];
+	qsize_t db_curinodes[DQ_BATCH_SIZE];
+	qsize_t db_bhardlimit[DQ_BATCH_SIZE];
+	qsize_t db_bsoftlimit[DQ_BATCH_SIZE];
+	qsize_t db_ihardlimit[DQ_BATCH_SIZE];
+	qsize_t db_isoftlimit[DQ_BATCH_SIZE];
+	time_t db_btime[DQ_BATCH_SIZE];
+	time_t db_itime[DQ_BATCH_SIZE];
+	char *db_name[DQ_BATCH_SIZE];	/* Name of id if the scan knows it, NULL otherwise */
+};
+
 /* Flags for commit function (have effect only when quota in kernel is turned on) */
 #define COMMIT_USAGE QIF_USAGE
 #define COMMIT_LIMITS QIF_LIMITS
@@ -149,8 +174,12 @@ struct quotafile_ops {
 	int (*end_io) (struct quota_handle * h);	/* Write all changes and close quotafile */
 	int (*write_info) (struct quota_handle * h);	/* Write info about quotafile */
 	struct dquot *(*read_dquot) (struct quota_handle * h, qid_t id);	/* Read dquot into memory */
+	int (*read_dquots) (struct quota_handle * h, qid_t * ids, int count, struct dquot ** dquots);	/* Read dquots for several ids into memory */
 	int (*commit_dquot) (struct dquot * dquot, int flag);	/* Write given dquot to disk */
+	int (*commit_dquots) (struct quota_handle * h, struct dquot ** dquots, int count);	/* Write dquots sorted by id to newly created quotafile */
+	int (*flush) (struct quota_handle * h);	/* Write changes cached in memory (except for info) */
 	int (*scan_dquots) (struct quota_handle * h, int (*process_dquot) (struct dquot * dquot, char * dqname));	/* Scan quotafile and call callback on every structure */
+	int (*scan_dquots_batch) (struct quota_handle * h, int (*process_batch) (struct dquot_batch * batch));	/* Scan quotafile and call callback on batches of structures */
 	int (*report) (struct quota_handle * h, int verbose);	/* Function called after 'repquota' to print format specific file information */
 };
 
@@ -176,9 +205,62 @@ struct quota_handle *new_io(struct mount_entry *mnt, int type, int fmt);
 /* Close quotafile */
 int end_io(struct quota_handle *h);
 
+/* Start collecting changes of quota structures in memory */
+void begin_batch(struct quota_handle *h);
+
+/* Write changes collected since begin_batch() */
+int end_batch(struct quota_handle *h);
+
+/* Read dquots for several ids at once */
+int read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots);
+
+/* Scan quotafile and call callback on batches of structures */
+int scan_dquots_batch(struct quota_handle *h, int (*process_batch)(struct dquot_batch *batch));
+
 /* Get empty quota structure */
 struct dquot *get_empty_dquot(void);
 
+/* Get empty batch of quota structures */
+struct dquot_batch *get_empty_dquot_batch(struct quota_handle *h);
+
+/* Pass nonempty batch to the callback and empty it */
+int flush_dquot_batch(struct dquot_batch *batch, int (*process_batch)(struct dquot_batch *batch));
+
+/* Add quota structure to the batch, the batch must not be full */
+static inline void dquot_batch_add(struct dquot_batch *b, qid_t id, struct util_dqblk *dqb)
+{
+	int i = b->db_count++;
+
+	b->db_id[i] = id;
+	b->db_curspace[i] = dqb->dqb_curspace;
+	b->db_curinodes[i] = dqb->dqb_curinodes;
+	b->db_bhardlimit[i] = dqb->dqb_bhardlimit;
+	b->db_bsoftlimit[i] = dqb->dqb_bsoftlimit;
+	b->db_ihardlimit[i] = dqb->dqb_ihardlimit;
+	b->db_isoftlimit[i] = dqb->dqb_isoftlimit;
+	b->db_btime[i] = dqb->dqb_btime;
+	b->db_itime[i] = dqb->dqb_itime;
+	b->db_name[i] = NULL;
+}
+
+/* Copy entry of the batch to quota structure */
+static inline void dquot_batch_get(struct dquot_batch *b, int i, struct dquot *dquot)
+{
+	struct util_dqblk *dqb = &dquot->dq_dqb;
+
+	memset(dquot, 0, sizeof(struct dquot));
+	dquot->dq_h = b->db_h;
+	dquot->dq_id = b->db_id[i];
+	dqb->dqb_curspace = b->db_curspace[i];
+	dqb->dqb_curinodes = b->db_curinodes[i];
+	dqb->dqb_bhardlimit = b->db_bhardlimit[i];
+	dqb->dqb_bsoftlimit = b->db_bsoftlimit[i];
+	dqb->dqb_ihardlimit = b->db_ihardlimit[i];
+	dqb->dqb_isoftlimit = b->db_isoftlimit[i];
+	dqb->dqb_btime = b->db_btime[i];
+	dqb->dqb_itime = b->db_itime[i];
+}
+
 /* Check whether values in current dquot can be stored on disk */
 int check_dquot_range(struct dquot *dquot);
 
@@ -11,6 +11,7 @@
 #include <pwd.h>
 #include <grp.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #include "pot.h"
@@ -18,6 +19,7 @@
 #include "quotaio.h"
 #include "quota.h"
 #include "quotasys.h"
+#include "quotaio_generic.h"
 
 /* Convert kernel quotablock format to utility one */
 static inline void generic_kern2utildqblk(struct util_dqblk *u, struct if_dqblk *k)
@@ -215,3 +217,201 @@ int vfs_scan_dquots(struct quota_handle *h,
 		return 0;
 	return ret;
 }
+
+int kernel_scan_dquots(struct quota_handle *h,
+		       int (*process_dquot)(struct dquot *dquot, char *dqname))
+{
+	struct if_nextdqblk kdqblk;
+	int ret;
+
+	ret = quotactl_handle(Q_GETNEXTQUOTA, h, 0, (void *)&kdqblk);
+	/*
+	 * Fall back to scanning using passwd if Q_GETNEXTQUOTA is not
+	 * supported
+	 */
+	if (ret < 0 && (errno == ENOSYS || errno == EINVAL))
+		return generic_scan_dquots(h, process_dquot, vfs_get_dquot);
+	return vfs_scan_dquots(h, process_dquot);
+}
+
+/* State of scan_dquots() collecting dquots into batches */
+struct batch_scan {
+	struct dquot_batch *batch;
+	int (*process_batch)(struct dquot_batch *batch);
+};
+
+/* Pass the batch to the callback and free names copied into it */
+static int process_named_batch(struct batch_scan *s, int call)
+{
+	struct dquot_batch *b = s->batch;
+	int i, ret = 0;
+
+	if (call && b->db_count)
+		ret = s->process_batch(b);
+	for (i = 0; i < b->db_count; i++)
+		free(b->db_name[i]);
+	b->db_count = 0;
+	return ret;
+}
+
+static int batch_one_dquot(struct dquot *dquot, char *dqname)
+{
+	struct batch_scan *s = dquot->dq_h->qh_scan_ctx;
+	struct dquot_batch *b = s->batch;
+
+	dquot_batch_add(b, dquot->dq_id, &dquot->dq_dqb);
+	if (dqname)
+		b->db_name[b->db_count - 1] = sstrdup(dqname);
+	if (b->db_count == DQ_BATCH_SIZE)
+		return process_named_batch(s, 1);
+	return 0;
+}
+
+/*
+ * The scan state is handed to batch_one_dquot() through the handle. Callbacks
+ * may start another scan of the same handle so restore the outer context when
+ * we are done.
+ */
+int generic_scan_dquots_batch(struct quota_handle *h,
+			      int (*process_batch)(struct dquot_batch *batch))
+{
+	struct batch_scan s;
+	void *outer = h->qh_scan_ctx;
+	int ret;
+
+	if (!h->qh_ops->scan_dquots) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	s.batch = get_empty_dquot_batch(h);
+	s.process_batch = process_batch;
+	h->qh_scan_ctx = &s;
+	ret = h->qh_ops->scan_dquots(h, batch_one_dquot);
+	h->qh_scan_ctx = outer;
+	if (process_named_batch(&s, ret >= 0) < 0)
+		ret = -1;
+	free(s.batch);
+	return ret;
+}
+
+int vfs_scan_dquots_batch(struct quota_handle *h,
+			  int (*process_batch)(struct dquot_batch *batch))
+{
+	struct dquot_batch *b = get_empty_dquot_batch(h);
+	struct if_nextdqblk kdqblk;
+	qid_t id = 0;
+	int i, ret;
+
+	while (1) {
+		ret = quotactl_handle(Q_GETNEXTQUOTA, h, id, (void *)&kdqblk);
+		if (ret < 0)
+			break;
+		i = b->db_count++;
+		b->db_id[i] = kdqblk.dqb_id;
+		b->db_curspace[i] = kdqblk.dqb_curspace;
+		b->db_curinodes[i] = kdqblk.dqb_curinodes;
+		b->db_bhardlimit[i] = kdqblk.dqb_bhardlimit;
+		b->db_bsoftlimit[i] = kdqblk.dqb_bsoftlimit;
+		b->db_ihardlimit[i] = kdqblk.dqb_ihardlimit;
+		b->db_isoftlimit[i] = kdqblk.dqb_isoftlimit;
+		b->db_btime[i] = kdqblk.dqb_btime;
+		b->db_itime[i] = kdqblk.dqb_itime;
+		b->db_name[i] = NULL;
+		if (b->db_count == DQ_BATCH_SIZE && flush_dquot_batch(b, process_batch) < 0) {
+			free(b);
+			return -1;
+		}
+		id = kdqblk.dqb_id + 1;
+		/* id -1 is invalid and the last one... */
+		if (id == -1) {
+			errno = ENOENT;
+			break;
+		}
+	}
+	if (errno == ENOENT)
+		ret = flush_dquot_batch(b, process_batch);
+	free(b);
+	return ret;
+}
+
+int kernel_scan_dquots_batch(struct quota_handle *h,
+			     int (*process_batch)(struct dquot_batch *batch))
+{
+	struct if_nextdqblk kdqblk;
+	int ret;
+
+	ret = quotactl_handle(Q_GETNEXTQUOTA, h, 0, (void *)&kdqblk);
+	if (ret < 0 && (errno == ENOSYS || errno == EINVAL))
+		return generic_scan_dquots_batch(h, process_batch);
+	return vfs_scan_dquots_batch(h, process_batch);
+}
+
+/* Read dquots one by one when quota format has no better way */
+int generic_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots)
+{
+	int i, err;
+
+	for (i = 0; i < count; i++) {
+		if (!(dquots[i] = h->qh_ops->read_dquot(h, ids[i]))) {
+			err = errno;
+			while (--i >= 0)
+				free(dquots[i]);
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Lookups of ids handed out to reading threads */
+struct read_work {
+	struct quota_handle *h;
+	qid_t *ids;
+	struct dquot **dquots;
+	int count;
+	int next;		/* Next id to read */
+	int err;		/* Error of failed read (or 0) */
+};
+
+static void *read_worker(void *arg)
+{
+	struct read_work *work = arg;
+	int i;
+
+	while (!__atomic_load_n(&work->err, __ATOMIC_RELAXED) &&
+	       (i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->count) {
+		work->dquots[i] = work->h->qh_ops->read_dquot(work->h, work->ids[i]);
+		if (!work->dquots[i])
+			__atomic_store_n(&work->err, errno ? errno : EIO, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+/*
+ * Read dquots from kernel. Each read is a separate quotactl so spread them
+ * over several threads.
+ */
+int kernel_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots)
+{
+	struct read_work work = { .h = h, .ids = ids, .dquots = dquots, .count = count };
+	pthread_t threads[KERNEL_READ_THREADS];
+	int i, started;
+
+	if (count < KERNEL_READ_MIN_PARALLEL)
+		return generic_read_dquots(h, ids, count, dquots);
+	memset(dquots, 0, sizeof(struct dquot *) * count);
+	for (started = 0; started < KERNEL_READ_THREADS; started++)
+		if (pthread_create(threads + started, NULL, read_worker, &work))
+			break;
+	/* Read in this thread as well, this also covers failure to start threads */
+	read_worker(&work);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	if (work.err) {
+		for (i = 0; i < count; i++)
+			free(dquots[i]);
+		errno = work.err;
+		return -1;
+	}
+	return 0;
+}
@@ -31,4 +31,30 @@ int generic_scan_dquots(struct quota_handle *h,
 int vfs_scan_dquots(struct quota_handle *h,
 		    int (*process_dquot)(struct dquot *dquot, char *dqname));
 
+/* Scan all dquots kernel knows about, use passwd when the kernel cannot
+ * iterate them */
+int kernel_scan_dquots(struct quota_handle *h,
+		       int (*process_dquot)(struct dquot *dquot, char *dqname));
+
+/* Scan dquots in batches using scan_dquots() of the format */
+int generic_scan_dquots_batch(struct quota_handle *h,
+			      int (*process_batch)(struct dquot_batch *batch));
+
+/* Scan all dquots using kernel quotactl and pass them in batches */
+int vfs_scan_dquots_batch(struct quota_handle *h,
+			  int (*process_batch)(struct dquot_batch *batch));
+
+/* Scan all dquots kernel knows about in batches */
+int kernel_scan_dquots_batch(struct quota_handle *h,
+			     int (*process_batch)(struct dquot_batch *batch));
+
+/* Read dquots for given ids one by one */
+int generic_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots);
+
+#define KERNEL_READ_THREADS 7		/* Threads reading dquots in addition to the caller */
+#define KERNEL_READ_MIN_PARALLEL 32	/* Read fewer dquots without threads */
+
+/* Read dquots for given ids from kernel using several threads */
+int kernel_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots);
+
 #endif
@@ -52,23 +52,15 @@ static int meta_commit_dquot(struct dquot *dquot, int flags)
 
 static int meta_scan_dquots(struct quota_handle *h, int (*process_dquot)(struct dquot *dquot, char *dqname))
 {
-	struct if_nextdqblk kdqblk;
-	int ret;
-
-	ret = quotactl_handle(Q_GETNEXTQUOTA, h, 0, (void *)&kdqblk);
-	/*
-	 * Fall back to scanning using passwd if Q_GETNEXTQUOTA is not
-	 * supported
-	 */
-	if (ret < 0 && (errno == ENOSYS || errno == EINVAL))
-		return generic_scan_dquots(h, process_dquot, vfs_get_dquot);
-	return vfs_scan_dquots(h, process_dquot);
+	return kernel_scan_dquots(h, process_dquot);
 }
 
 struct quotafile_ops quotafile_ops_meta = {
 init_io:	meta_init_io,
 write_info:	meta_write_info,
 read_dquot:	meta_read_dquot,
+read_dquots:	kernel_read_dquots,
 commit_dquot:	meta_commit_dquot,
 scan_dquots:	meta_scan_dquots,
+scan_dquots_batch:	kernel_scan_dquots_batch,
 };
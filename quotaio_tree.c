@@ -13,6 +13,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <endian.h>
+#include <sys/uio.h>
 
 #include "pot.h"
 #include "common.h"
@@ -47,26 +48,50 @@ static int get_index(qid_t id, int depth)
 	return (id >> ((QT_TREEDEPTH - depth - 1) * 8)) & 0xff;
 }
 
-/* Read given block */
-static void read_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
+/*
+ * Blocks of the quota tree are cached in memory. Lookups of different ids go
+ * through the same root and upper index blocks so this saves most of the
+ * reads. Blocks changed by an update of the tree are written when the update
+ * is done. Inside a batch (see begin_batch()) changed blocks are never evicted
+ * and they are all written when the batch ends.
+ */
+#define QT_CACHE_BLOCKS	256	/* Maximum number of blocks cached for a file */
+#define QT_CACHE_HASH	64	/* Size of hash table of cached blocks */
+
+struct qtree_cache_blk {
+	uint blk;				/* Number of the block */
+	int dirty;				/* Does block need writing? */
+	int index;				/* Is it a block of the tree index? */
+	struct qtree_cache_blk *hash_next;	/* Next block in hash chain */
+	struct qtree_cache_blk *lru_prev, *lru_next;	/* LRU list */
+	char data[QT_BLKSIZE];
+};
+
+struct qtree_cache {
+	struct qtree_cache_blk *hash[QT_CACHE_HASH];
+	struct qtree_cache_blk lru;		/* Head of LRU list, most recently used first */
+	int count;				/* Number of cached blocks */
+	int dirty;				/* Number of changed blocks */
+};
+
+/* Read block from the file */
+static void disk_read_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
 {
 	int err;
 
-	lseek(h->qh_fd, blk << QT_BLKSIZE_BITS, SEEK_SET);
-	err = read(h->qh_fd, buf, QT_BLKSIZE);
+	err = pread(h->qh_fd, buf, QT_BLKSIZE, (loff_t)blk << QT_BLKSIZE_BITS);
 	if (err < 0)
 		die(2, _("Cannot read block %u: %s\n"), blk, strerror(errno));
 	else if (err != QT_BLKSIZE)
 		memset(buf + err, 0, QT_BLKSIZE - err);
 }
 
-/* Write block */
-static int write_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
+/* Write block to the file */
+static int disk_write_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
 {
 	int err;
 
-	lseek(h->qh_fd, blk << QT_BLKSIZE_BITS, SEEK_SET);
-	err = write(h->qh_fd, buf, QT_BLKSIZE);
+	err = pwrite(h->qh_fd, buf, QT_BLKSIZE, (loff_t)blk << QT_BLKSIZE_BITS);
 	if (err < 0 && errno != ENOSPC)
 		die(2, _("Cannot write block (%u): %s\n"), blk, strerror(errno));
 	if (err != QT_BLKSIZE)
@@ -74,6 +99,245 @@ static int write_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
 	return 0;
 }
 
+static inline void cache_lru_del(struct qtree_cache_blk *cb)
+{
+	cb->lru_prev->lru_next = cb->lru_next;
+	cb->lru_next->lru_prev = cb->lru_prev;
+}
+
+static inline void cache_lru_add(struct qtree_cache *c, struct qtree_cache_blk *cb)
+{
+	cb->lru_next = c->lru.lru_next;
+	cb->lru_prev = &c->lru;
+	c->lru.lru_next->lru_prev = cb;
+	c->lru.lru_next = cb;
+}
+
+/*
+ * Find block in the cache or get a buffer for it (block contents is not read).
+ * Returns NULL when a changed block cannot be written to make space.
+ */
+static struct qtree_cache_blk *cache_get_blk(struct quota_handle *h, uint blk, int *found)
+{
+	struct qtree_cache *c = h->qh_cache;
+	struct qtree_cache_blk *cb, **pcb;
+
+	if (!c) {
+		c = h->qh_cache = smalloc(sizeof(struct qtree_cache));
+		memset(c, 0, sizeof(struct qtree_cache));
+		c->lru.lru_next = c->lru.lru_prev = &c->lru;
+	}
+	for (cb = c->hash[blk % QT_CACHE_HASH]; cb; cb = cb->hash_next) {
+		if (cb->blk == blk) {
+			cache_lru_del(cb);
+			cache_lru_add(c, cb);
+			*found = 1;
+			return cb;
+		}
+	}
+	*found = 0;
+	if (c->count < QT_CACHE_BLOCKS ||
+	    ((h->qh_io_flags & IOFL_BATCH) && c->lru.lru_prev->dirty)) {
+		cb = smalloc(sizeof(struct qtree_cache_blk));
+		c->count++;
+	}
+	else {
+		/* Reuse the least recently used block */
+		cb = c->lru.lru_prev;
+		if (cb->dirty) {
+			if (disk_write_blk(h, cb->blk, cb->data) < 0) {
+				errno = ENOSPC;
+				return NULL;
+			}
+			c->dirty--;
+		}
+		cache_lru_del(cb);
+		for (pcb = &c->hash[cb->blk % QT_CACHE_HASH]; *pcb != cb; pcb = &(*pcb)->hash_next);
+		*pcb = cb->hash_next;
+	}
+	cb->blk = blk;
+	cb->dirty = 0;
+	cb->hash_next = c->hash[blk % QT_CACHE_HASH];
+	c->hash[blk % QT_CACHE_HASH] = cb;
+	cache_lru_add(c, cb);
+	return cb;
+}
+
+/* Read given block */
+static void read_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
+{
+	struct qtree_cache_blk *cb;
+	int found;
+
+	cb = cache_get_blk(h, blk, &found);
+	if (!cb) {
+		/* No space in the cache, read the block directly */
+		disk_read_blk(h, blk, buf);
+		return;
+	}
+	if (!found)
+		disk_read_blk(h, blk, cb->data);
+	memcpy(buf, cb->data, QT_BLKSIZE);
+}
+
+/*
+ * Get block for reading. Mapped files are accessed directly, otherwise the
+ * block is read into *buf which gets allocated when needed.
+ */
+static char *get_blk(struct quota_handle *h, uint blk, dqbuf_t *buf)
+{
+	if (h->qh_map && ((size_t)blk + 1) << QT_BLKSIZE_BITS <= h->qh_map_len)
+		return h->qh_map + ((size_t)blk << QT_BLKSIZE_BITS);
+	if (!*buf)
+		*buf = getdqbuf();
+	read_blk(h, blk, *buf);
+	return *buf;
+}
+
+/* Write block (the write happens when the cache is flushed) */
+static int cache_write_blk(struct quota_handle *h, uint blk, dqbuf_t buf, int index)
+{
+	struct qtree_cache_blk *cb;
+	int found;
+
+	cb = cache_get_blk(h, blk, &found);
+	if (!cb)	/* No space in the cache, write the block directly */
+		return disk_write_blk(h, blk, buf);
+	memcpy(cb->data, buf, QT_BLKSIZE);
+	if (!cb->dirty)
+		h->qh_cache->dirty++;
+	cb->dirty = 1;
+	cb->index = index;
+	return 0;
+}
+
+/* Write data block or block of the free list */
+static inline int write_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
+{
+	return cache_write_blk(h, blk, buf, 0);
+}
+
+/* Write block of the tree index */
+static inline int write_idx_blk(struct quota_handle *h, uint blk, dqbuf_t buf)
+{
+	return cache_write_blk(h, blk, buf, 1);
+}
+
+static int cache_blk_cmp(const void *a, const void *b)
+{
+	const struct qtree_cache_blk *ca = *(const struct qtree_cache_blk **)a;
+	const struct qtree_cache_blk *cb = *(const struct qtree_cache_blk **)b;
+
+	if (ca->blk < cb->blk)
+		return -1;
+	if (ca->blk > cb->blk)
+		return 1;
+	return 0;
+}
+
+/* Write given blocks sorted by block number, runs of adjacent blocks at once */
+static int write_blk_run(struct quota_handle *h, struct qtree_cache_blk **blks, int count)
+{
+	struct iovec iov[QT_CACHE_BLOCKS];
+	int i, j, n, ret = 0;
+	ssize_t len;
+
+	for (i = 0; i < count; i = j) {
+		n = 0;
+		for (j = i; j < count && n < QT_CACHE_BLOCKS &&
+		     blks[j]->blk == blks[i]->blk + (j - i); j++, n++) {
+			iov[n].iov_base = blks[j]->data;
+			iov[n].iov_len = QT_BLKSIZE;
+		}
+		len = pwritev(h->qh_fd, iov, n, (loff_t)blks[i]->blk << QT_BLKSIZE_BITS);
+		if (len < 0 && errno != ENOSPC)
+			die(2, _("Cannot write block (%u): %s\n"), blks[i]->blk, strerror(errno));
+		if (len != (ssize_t)n * QT_BLKSIZE) {
+			errno = ENOSPC;
+			ret = -1;
+			continue;
+		}
+		h->qh_cache->dirty -= n;
+		while (n--)
+			blks[i + n]->dirty = 0;
+	}
+	return ret;
+}
+
+/*
+ * Write all changed blocks in the cache to the file. Data blocks (and blocks
+ * of free lists) are written before index blocks so that the index never
+ * points to data which is not written yet.
+ */
+int qtree_flush_cache(struct quota_handle *h)
+{
+	struct qtree_cache_blk *cb, **blks;
+	int ret = 0, dcount = 0, icount = 0, count;
+
+	if (!h->qh_cache || !h->qh_cache->dirty)
+		return 0;
+	count = h->qh_cache->count;
+	blks = smalloc(sizeof(struct qtree_cache_blk *) * count);
+	for (cb = h->qh_cache->lru.lru_next; cb != &h->qh_cache->lru; cb = cb->lru_next) {
+		if (!cb->dirty)
+			continue;
+		if (cb->index)
+			blks[count - ++icount] = cb;
+		else
+			blks[dcount++] = cb;
+	}
+	qsort(blks, dcount, sizeof(struct qtree_cache_blk *), cache_blk_cmp);
+	qsort(blks + count - icount, icount, sizeof(struct qtree_cache_blk *), cache_blk_cmp);
+	if (write_blk_run(h, blks, dcount) < 0)
+		ret = -1;
+	if (write_blk_run(h, blks + count - icount, icount) < 0)
+		ret = -1;
+	free(blks);
+	return ret;
+}
+
+/*
+ * Write changes accumulated in a batch in block order and drop clean blocks
+ * over the normal size of the cache
+ */
+int qtree_end_batch(struct quota_handle *h)
+{
+	struct qtree_cache *c = h->qh_cache;
+	struct qtree_cache_blk *cb, **pcb;
+	int ret;
+
+	if (!c)
+		return 0;
+	ret = qtree_flush_cache(h);
+	while (c->count > QT_CACHE_BLOCKS && !c->lru.lru_prev->dirty) {
+		cb = c->lru.lru_prev;
+		cache_lru_del(cb);
+		for (pcb = &c->hash[cb->blk % QT_CACHE_HASH]; *pcb != cb; pcb = &(*pcb)->hash_next);
+		*pcb = cb->hash_next;
+		free(cb);
+		c->count--;
+	}
+	return ret;
+}
+
+/* Write changed blocks and free the cache */
+int qtree_free_cache(struct quota_handle *h)
+{
+	struct qtree_cache_blk *cb, *next;
+	int ret;
+
+	if (!h->qh_cache)
+		return 0;
+	ret = qtree_flush_cache(h);
+	for (cb = h->qh_cache->lru.lru_next; cb != &h->qh_cache->lru; cb = next) {
+		next = cb->lru_next;
+		free(cb);
+	}
+	free(h->qh_cache);
+	h->qh_cache = NULL;
+	return ret;
+}
+
 /* Get free block in file (either from free list or create new one) */
 static int get_free_dqblk(struct quota_handle *h)
 {
@@ -89,7 +353,7 @@ static int get_free_dqblk(struct quota_handle *h)
 	}
 	else {
 		memset(buf, 0, QT_BLKSIZE);
-		if (write_blk(h, info->dqi_blocks, buf) < 0) {	/* Assure block allocation... */
+		if (disk_write_blk(h, info->dqi_blocks, buf) < 0) {	/* Assure block allocation... */
 			freedqbuf(buf);
 			errstr(_("Cannot allocate new quota block (out of disk space).\n"));
 			return -ENOSPC;
@@ -242,7 +506,7 @@ static int do_insert_tree(struct quota_handle *h, struct dquot *dquot, uint * tr
 		ret = do_insert_tree(h, dquot, &newblk, depth + 1);
 	if (newson && ret >= 0) {
 		ref[get_index(dquot->dq_id, depth)] = htole32(newblk);
-		write_blk(h, *treeblk, buf);
+		write_idx_blk(h, *treeblk, buf);
 	}
 	else if (newact && ret < 0)
 		put_free_dqblk(h, buf, *treeblk);
@@ -260,24 +524,177 @@ static void dq_insert_tree(struct quota_handle *h, struct dquot *dquot)
 		die(2, _("Cannot write quota (id %u): %s\n"), (uint) dquot->dq_id, strerror(errno));
 }
 
+/* Outside of a batch, write blocks changed by an update of the tree */
+static int write_changes(struct quota_handle *h)
+{
+	if (h->qh_io_flags & IOFL_BATCH)
+		return 0;
+	return qtree_flush_cache(h);
+}
+
 /* Write dquot to file */
-void qtree_write_dquot(struct dquot *dquot)
+int qtree_write_dquot(struct dquot *dquot)
 {
-	ssize_t ret;
 	struct qtree_mem_dqinfo *info = &dquot->dq_h->qh_info.u.v2_mdqi.dqi_qtree;
-	char *ddquot = smalloc(info->dqi_entry_size);
+	dqbuf_t buf = getdqbuf();
+	loff_t off;
+	int ret;
 
 	if (!dquot->dq_dqb.u.v2_mdqb.dqb_off)
 		dq_insert_tree(dquot->dq_h, dquot);
-	lseek(dquot->dq_h->qh_fd, dquot->dq_dqb.u.v2_mdqb.dqb_off, SEEK_SET);
-	info->dqi_ops->mem2disk_dqblk(ddquot, dquot);
-	ret = write(dquot->dq_h->qh_fd, ddquot, info->dqi_entry_size);
-	free(ddquot);
-	if (ret != info->dqi_entry_size) {
-		if (ret > 0)
-			errno = ENOSPC;
-		die(2, _("Quota write failed (id %u): %s\n"), (uint)dquot->dq_id, strerror(errno));
+	off = dquot->dq_dqb.u.v2_mdqb.dqb_off;
+	read_blk(dquot->dq_h, off >> QT_BLKSIZE_BITS, buf);
+	info->dqi_ops->mem2disk_dqblk(buf + (off & (QT_BLKSIZE - 1)), dquot);
+	ret = write_blk(dquot->dq_h, off >> QT_BLKSIZE_BITS, buf);
+	freedqbuf(buf);
+	if (write_changes(dquot->dq_h) < 0 || ret < 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+/* Quota file being built in memory */
+struct qtree_bulk {
+	char *buf;		/* Blocks starting with QT_TREEOFF */
+	uint blocks;		/* Number of blocks in file (including header block) */
+	uint allocated;		/* Number of blocks buf has space for */
+};
+
+#define bulk_blk(b, blk) ((b)->buf + ((size_t)((blk) - QT_TREEOFF) << QT_BLKSIZE_BITS))
+
+/* Append zeroed block to file built in memory */
+static uint bulk_get_blk(struct qtree_bulk *b)
+{
+	if (b->blocks - QT_TREEOFF == b->allocated) {
+		b->allocated *= 2;
+		b->buf = srealloc(b->buf, (size_t)b->allocated << QT_BLKSIZE_BITS);
+		memset(bulk_blk(b, b->blocks), 0,
+		       (size_t)(b->allocated - (b->blocks - QT_TREEOFF)) << QT_BLKSIZE_BITS);
+	}
+	return b->blocks++;
+}
+
+/* Does dquot have anything to store in the file? */
+static int bulk_dquot_empty(struct dquot *dquot)
+{
+	struct util_dqblk *m = &dquot->dq_dqb;
+
+	return !m->dqb_curspace && !m->dqb_curinodes && !m->dqb_bsoftlimit &&
+	       !m->dqb_isoftlimit && !m->dqb_bhardlimit && !m->dqb_ihardlimit;
+}
+
+/* Return block referencing given id at given depth of tree built in memory */
+static uint bulk_tree_blk(struct qtree_bulk *b, qid_t id, int depth)
+{
+	uint blk = QT_TREEOFF;
+	int i;
+
+	for (i = 0; i < depth; i++)
+		blk = le32toh(((u_int32_t *)bulk_blk(b, blk))[get_index(id, i)]);
+	return blk;
+}
+
+/*
+ * Write all dquots to a freshly created quota file at once. Dquots have to be
+ * sorted by id. The tree and data blocks are built in memory and written
+ * sequentially so we avoid read-modify-write cycles of do_insert_tree().
+ * Tree blocks are allocated level by level before all data blocks so index
+ * lookups stay in the beginning of the file. Dquots without any usage or
+ * limits are skipped as qtree_delete_dquot() would do.
+ */
+int qtree_write_dquots(struct quota_handle *h, struct dquot **dquots, int count)
+{
+	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
+	int perblk = qtree_dqstr_in_blk(info);
+	struct qtree_bulk b;
+	struct qt_disk_dqdbheader *dh = NULL;
+	uint datablk = 0, blk;
+	u_int32_t *ref;
+	int i, depth, entries = 0, ret = 0;
+	size_t len, done;
+	ssize_t written;
+
+	if (info->dqi_blocks != QT_TREEOFF + 1 || info->dqi_free_blk || info->dqi_free_entry) {
+		errno = EINVAL;
+		return -1;
 	}
+	for (i = 0; i < count; i++) {
+		if (bulk_dquot_empty(dquots[i]))
+			dquots[i]->dq_dqb.u.v2_mdqb.dqb_off = 0;
+		else if (check_dquot_range(dquots[i]) < 0) {
+			errno = ERANGE;
+			return -1;
+		}
+	}
+	/* Blocks are written directly so the cache must not hold any */
+	if (qtree_free_cache(h) < 0)
+		return -1;
+	b.allocated = 64;
+	b.buf = smalloc((size_t)b.allocated << QT_BLKSIZE_BITS);
+	memset(b.buf, 0, (size_t)b.allocated << QT_BLKSIZE_BITS);
+	b.blocks = QT_TREEOFF;
+	bulk_get_blk(&b);	/* Root of the tree */
+
+	for (depth = 0; depth < QT_TREEDEPTH - 1; depth++) {
+		for (i = 0; i < count; i++) {
+			qid_t id = dquots[i]->dq_id;
+
+			if (bulk_dquot_empty(dquots[i]))
+				continue;
+			ref = (u_int32_t *)bulk_blk(&b, bulk_tree_blk(&b, id, depth));
+			if (ref[get_index(id, depth)])
+				continue;
+			blk = bulk_get_blk(&b);
+			/* Buffer might have moved */
+			ref = (u_int32_t *)bulk_blk(&b, bulk_tree_blk(&b, id, depth));
+			ref[get_index(id, depth)] = htole32(blk);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		struct dquot *dquot = dquots[i];
+
+		if (bulk_dquot_empty(dquot))
+			continue;
+		if (!datablk || entries == perblk) {
+			datablk = bulk_get_blk(&b);
+			entries = 0;
+		}
+		ref = (u_int32_t *)bulk_blk(&b, bulk_tree_blk(&b, dquot->dq_id, QT_TREEDEPTH - 1));
+		if (ref[get_index(dquot->dq_id, QT_TREEDEPTH - 1)])
+			die(2, _("Inserting already present quota entry (block %u).\n"),
+			    le32toh(ref[get_index(dquot->dq_id, QT_TREEDEPTH - 1)]));
+		ref[get_index(dquot->dq_id, QT_TREEDEPTH - 1)] = htole32(datablk);
+		dh = (struct qt_disk_dqdbheader *)bulk_blk(&b, datablk);
+		dh->dqdh_entries = htole16(++entries);
+		dquot->dq_dqb.u.v2_mdqb.dqb_off = ((loff_t)datablk << QT_BLKSIZE_BITS) +
+			sizeof(struct qt_disk_dqdbheader) + (entries - 1) * info->dqi_entry_size;
+		info->dqi_ops->mem2disk_dqblk(bulk_blk(&b, datablk) +
+			sizeof(struct qt_disk_dqdbheader) + (entries - 1) * info->dqi_entry_size,
+			dquot);
+	}
+	/* Last data block has free entries so it has to be on the list */
+	if (datablk && entries < perblk)
+		info->dqi_free_entry = datablk;
+
+	len = (size_t)(b.blocks - QT_TREEOFF) << QT_BLKSIZE_BITS;
+	for (done = 0; done < len; done += written) {
+		written = pwrite(h->qh_fd, b.buf + done, len - done,
+				 ((loff_t)QT_TREEOFF << QT_BLKSIZE_BITS) + done);
+		if (written < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
+			}
+			ret = -1;
+			goto out;
+		}
+	}
+	info->dqi_blocks = b.blocks;
+	mark_quotafile_info_dirty(h);
+out:
+	free(b.buf);
+	return ret;
 }
 
 /* Free dquot entry in data block */
@@ -336,35 +753,43 @@ static void remove_tree(struct quota_handle *h, struct dquot *dquot, uint * blk,
 			*blk = 0;
 		}
 		else
-			write_blk(h, *blk, buf);
+			write_idx_blk(h, *blk, buf);
 	}
 	freedqbuf(buf);
 }
 
 /* Delete dquot from tree */
-void qtree_delete_dquot(struct dquot *dquot)
+int qtree_delete_dquot(struct dquot *dquot)
 {
 	uint tmp = QT_TREEOFF;
 
 	if (!dquot->dq_dqb.u.v2_mdqb.dqb_off)	/* Even not allocated? */
-		return;
+		return 0;
 	remove_tree(dquot->dq_h, dquot, &tmp, 0);
+	return write_changes(dquot->dq_h);
 }
 
-/* Find entry in block */
-static loff_t find_block_dqentry(struct quota_handle *h, struct dquot *dquot, uint blk)
+/* Find index of entry for dquot in data block */
+static int find_blk_entry(struct qtree_mem_dqinfo *info, char *data, struct dquot *dquot)
 {
-	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
-	dqbuf_t buf = getdqbuf();
+	char *ddquot = data + sizeof(struct qt_disk_dqdbheader);
 	int i;
-	char *ddquot = buf + sizeof(struct qt_disk_dqdbheader);
 
-	read_blk(h, blk, buf);
 	for (i = 0;
 	     i < qtree_dqstr_in_blk(info) && !info->dqi_ops->is_id(ddquot, dquot);
 	     i++, ddquot += info->dqi_entry_size);
 	if (i == qtree_dqstr_in_blk(info))
 		die(2, _("Quota for id %u referenced but not present.\n"), dquot->dq_id);
+	return i;
+}
+
+/* Find entry in block */
+static loff_t find_block_dqentry(struct quota_handle *h, struct dquot *dquot, uint blk)
+{
+	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
+	dqbuf_t buf = NULL;
+	int i = find_blk_entry(info, get_blk(h, blk, &buf), dquot);
+
 	freedqbuf(buf);
 	return (blk << QT_BLKSIZE_BITS) + sizeof(struct qt_disk_dqdbheader) +
 		i * info->dqi_entry_size;
@@ -373,12 +798,10 @@ static loff_t find_block_dqentry(struct quota_handle *h, struct dquot *dquot, ui
 /* Find entry for given id in the tree */
 static loff_t find_tree_dqentry(struct quota_handle *h, struct dquot *dquot, uint blk, int depth)
 {
-	dqbuf_t buf = getdqbuf();
+	dqbuf_t buf = NULL;
 	loff_t ret = 0;
-	u_int32_t *ref = (u_int32_t *) buf;
+	u_int32_t *ref = (u_int32_t *)get_blk(h, blk, &buf);
 
-	read_blk(h, blk, buf);
-	ret = 0;
 	blk = le32toh(ref[get_index(dquot->dq_id, depth)]);
 	if (!blk)		/* No reference? */
 		goto out_buf;
@@ -405,8 +828,7 @@ struct dquot *qtree_read_dquot(struct quota_handle *h, qid_t id)
 {
 	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
 	loff_t offset;
-	ssize_t ret;
-	char *ddquot = smalloc(info->dqi_entry_size);
+	dqbuf_t buf = NULL;
 	struct dquot *dquot = get_empty_dquot();
 
 	dquot->dq_id = id;
@@ -417,49 +839,201 @@ struct dquot *qtree_read_dquot(struct quota_handle *h, qid_t id)
 	offset = find_dqentry(h, dquot);
 	if (offset > 0) {
 		dquot->dq_dqb.u.v2_mdqb.dqb_off = offset;
-		lseek(h->qh_fd, offset, SEEK_SET);
-		ret = read(h->qh_fd, ddquot, info->dqi_entry_size);
-		if (ret != info->dqi_entry_size) {
-			if (ret > 0)
-				errno = EIO;
-			free(ddquot);
-			die(2, _("Cannot read quota structure for id %u: %s\n"), dquot->dq_id,
-			    strerror(errno));
-		}
-		info->dqi_ops->disk2mem_dqblk(dquot, ddquot);
+		info->dqi_ops->disk2mem_dqblk(dquot,
+			get_blk(h, offset >> QT_BLKSIZE_BITS, &buf) + (offset & (QT_BLKSIZE - 1)));
+		freedqbuf(buf);
 	}
-	free(ddquot);
 	return dquot;
 }
 
+struct qtree_id_order {
+	qid_t id;
+	int idx;	/* Position of id in the array passed by caller */
+};
+
+static int qtree_id_cmp(const void *a, const void *b)
+{
+	const struct qtree_id_order *x = a, *y = b;
+
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	return x->idx - y->idx;
+}
+
+/*
+ * Read dquots for several ids. Ids are looked up in sorted order so index
+ * blocks on the path shared with the previous id are not looked up again.
+ */
+int qtree_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots)
+{
+	struct qtree_mem_dqinfo *info = &h->qh_info.u.v2_mdqi.dqi_qtree;
+	struct qtree_id_order *order = smalloc(sizeof(struct qtree_id_order) * count);
+	/* Path to the last id, path[QT_TREEDEPTH] is the data block */
+	dqbuf_t bufs[QT_TREEDEPTH + 1] = { NULL };
+	char *path[QT_TREEDEPTH + 1];
+	uint pathblk[QT_TREEDEPTH + 1];
+	struct dquot *dquot;
+	int valid = 0, i, depth, entry;
+	qid_t id, prev = 0;
+
+	for (i = 0; i < count; i++) {
+		order[i].id = ids[i];
+		order[i].idx = i;
+	}
+	qsort(order, count, sizeof(struct qtree_id_order), qtree_id_cmp);
+	for (i = 0; i < count; i++) {
+		id = order[i].id;
+		dquot = get_empty_dquot();
+		dquot->dq_id = id;
+		dquot->dq_h = h;
+		dquots[order[i].idx] = dquot;
+
+		/* Blocks up to the first level where the ids differ stay valid */
+		for (depth = 0; depth < QT_TREEDEPTH && get_index(id, depth) == get_index(prev, depth); depth++);
+		if (valid > depth + 1)
+			valid = depth + 1;
+		if (!valid) {
+			pathblk[0] = QT_TREEOFF;
+			path[0] = get_blk(h, QT_TREEOFF, &bufs[0]);
+			valid = 1;
+		}
+		for (depth = valid; depth <= QT_TREEDEPTH; depth++) {
+			pathblk[depth] = le32toh(((u_int32_t *)path[depth - 1])[get_index(id, depth - 1)]);
+			if (!pathblk[depth])	/* No reference? */
+				break;
+			path[depth] = get_blk(h, pathblk[depth], &bufs[depth]);
+		}
+		valid = depth;
+		prev = id;
+		if (depth <= QT_TREEDEPTH)
+			continue;
+		entry = find_blk_entry(info, path[QT_TREEDEPTH], dquot);
+		dquot->dq_dqb.u.v2_mdqb.dqb_off = ((loff_t)pathblk[QT_TREEDEPTH] << QT_BLKSIZE_BITS) +
+			sizeof(struct qt_disk_dqdbheader) + entry * info->dqi_entry_size;
+		info->dqi_ops->disk2mem_dqblk(dquot, path[QT_TREEDEPTH] +
+			sizeof(struct qt_disk_dqdbheader) + entry * info->dqi_entry_size);
+	}
+	for (i = 0; i <= QT_TREEDEPTH; i++)
+		freedqbuf(bufs[i]);
+	free(order);
+	return 0;
+}
+
 /*
  *	Scan all dquots in file and call callback on each
+ *
+ *	The tree is scanned level by level. Blocks referenced from a batch of
+ *	index blocks are read in the order of their position in the file so
+ *	that scanning of a fragmented file does not seek back and forth. Data
+ *	blocks are still reported in the order in which the tree references
+ *	them so entries come in the order of ids.
  */
 #define set_bit(bmp, ind) ((bmp)[(ind) >> 3] |= (1 << ((ind) & 7)))
 #define get_bit(bmp, ind) ((bmp)[(ind) >> 3] & (1 << ((ind) & 7)))
 
-static int report_block(struct dquot *dquot, uint blk, char *bitmap,
-			int (*process_dquot) (struct dquot *, char *))
+#define QT_SCAN_BATCH	1024	/* Maximum number of blocks read in one batch */
+#define QT_SCAN_IOV	256	/* Maximum number of blocks read by one preadv() */
+
+struct scan_blk {
+	uint blk;	/* Number of block */
+	int idx;	/* Index of block in the batch */
+};
+
+static int scan_blk_cmp(const void *a, const void *b)
 {
-	struct qtree_mem_dqinfo *info = &dquot->dq_h->qh_info.u.v2_mdqi.dqi_qtree;
-	dqbuf_t buf = getdqbuf();
-	struct qt_disk_dqdbheader *dh;
-	char *ddata;
-	int entries, i;
+	const struct scan_blk *x = a, *y = b;
+
+	if (x->blk != y->blk)
+		return x->blk < y->blk ? -1 : 1;
+	return x->idx - y->idx;
+}
+
+/*
+ * Read a batch of blocks. data[i] is set to point to the contents of blks[i]
+ * which is either in the mapped file or in buf.
+ */
+static void read_blk_batch(struct quota_handle *h, uint *blks, int count, char *buf, char **data)
+{
+	struct scan_blk *sorted = smalloc(sizeof(struct scan_blk) * count);
+	struct iovec iov[QT_SCAN_IOV];
+	ssize_t ret;
+	size_t start;
+	int i, j, n;
+
+	for (i = 0; i < count; i++) {
+		sorted[i].blk = blks[i];
+		sorted[i].idx = i;
+	}
+	qsort(sorted, count, sizeof(struct scan_blk), scan_blk_cmp);
+	for (i = 0; i < count; i = j) {
+		/* Find a run of consecutive blocks */
+		for (j = i + 1; j < count && j - i < QT_SCAN_IOV &&
+		     sorted[j].blk == sorted[j - 1].blk + 1; j++);
+		if (h->qh_map &&
+		    ((size_t)sorted[j - 1].blk + 1) << QT_BLKSIZE_BITS <= h->qh_map_len) {
+			/* Touch the blocks so that the pages get faulted in file order */
+			for (n = i; n < j; n++) {
+				data[sorted[n].idx] = h->qh_map + ((size_t)sorted[n].blk << QT_BLKSIZE_BITS);
+				(void)*(volatile char *)data[sorted[n].idx];
+			}
+			continue;
+		}
+		for (n = i; n < j; n++) {
+			data[sorted[n].idx] = buf + ((size_t)sorted[n].idx << QT_BLKSIZE_BITS);
+			iov[n - i].iov_base = data[sorted[n].idx];
+			iov[n - i].iov_len = QT_BLKSIZE;
+		}
+		ret = preadv(h->qh_fd, iov, j - i, (off_t)sorted[i].blk << QT_BLKSIZE_BITS);
+		if (ret < 0)
+			die(2, _("Cannot read block %u: %s\n"), sorted[i].blk, strerror(errno));
+		/* Blocks beyond the end of file read as zeros */
+		for (n = i; n < j; n++) {
+			start = (size_t)(n - i) << QT_BLKSIZE_BITS;
+			if (start + QT_BLKSIZE <= ret)
+				continue;
+			if (start < ret)
+				memset(data[sorted[n].idx] + (ret - start), 0, QT_BLKSIZE - (ret - start));
+			else
+				memset(data[sorted[n].idx], 0, QT_BLKSIZE);
+		}
+	}
+	free(sorted);
+}
+
+/* State of a scan of the quota tree */
+struct qtree_scan {
+	struct quota_handle *h;
+	char *bitmap;			/* Data blocks already reported */
+	struct dquot *dquot;		/* Structure entries are decoded into */
+	int (*process_dquot) (struct dquot *, char *);
+	struct dquot_batch *batch;	/* Batch passed to process_batch() */
+	int (*process_batch) (struct dquot_batch *);
+	int err;			/* Did process_batch() fail? */
+};
+
+static int report_block(struct qtree_scan *s, char *data)
+{
+	struct qtree_mem_dqinfo *info = &s->h->qh_info.u.v2_mdqi.dqi_qtree;
+	struct qt_disk_dqdbheader *dh = (struct qt_disk_dqdbheader *)data;
+	char *ddata = data + sizeof(struct qt_disk_dqdbheader);
+	int i;
 
-	set_bit(bitmap, blk);
-	read_blk(dquot->dq_h, blk, buf);
-	dh = (struct qt_disk_dqdbheader *)buf;
-	ddata = buf + sizeof(struct qt_disk_dqdbheader);
-	entries = le16toh(dh->dqdh_entries);
 	for (i = 0; i < qtree_dqstr_in_blk(info); i++, ddata += info->dqi_entry_size)
 		if (!qtree_entry_unused(info, ddata)) {
-			info->dqi_ops->disk2mem_dqblk(dquot, ddata);
-			if (process_dquot(dquot, NULL) < 0)
+			info->dqi_ops->disk2mem_dqblk(s->dquot, ddata);
+			if (!s->batch) {
+				if (s->process_dquot(s->dquot, NULL) < 0)
+					break;
+				continue;
+			}
+			if (s->err)
 				break;
+			dquot_batch_add(s->batch, s->dquot->dq_id, &s->dquot->dq_dqb);
+			if (s->batch->db_count == DQ_BATCH_SIZE &&
+			    flush_dquot_batch(s->batch, s->process_batch) < 0)
+				s->err = 1;
 		}
-	freedqbuf(buf);
-	return entries;
+	return le16toh(dh->dqdh_entries);
 }
 
 static void check_reference(struct quota_handle *h, uint blk)
@@ -468,31 +1042,51 @@ static void check_reference(struct quota_handle *h, uint blk)
 		die(2, _("Illegal reference (%u >= %u) in %s quota file on %s. Quota file is probably corrupted.\nPlease run quotacheck(8) and try again.\n"), blk, h->qh_info.u.v2_mdqi.dqi_qtree.dqi_blocks, type2name(h->qh_type), h->qh_quotadev);
 }
 
-static int report_tree(struct dquot *dquot, uint blk, int depth, char *bitmap,
-		       int (*process_dquot) (struct dquot *, char *))
+/*
+ * Report blocks of given depth of the tree (depth QT_TREEDEPTH are data
+ * blocks) and everything below them
+ */
+static int report_tree(struct qtree_scan *s, uint *blks, int count, int depth)
 {
-	int entries = 0, i;
-	dqbuf_t buf = getdqbuf();
-	u_int32_t *ref = (u_int32_t *) buf;
+	struct quota_handle *h = s->h;
+	char *bitmap = s->bitmap;
+	char *buf = smalloc((size_t)count << QT_BLKSIZE_BITS);
+	char **data = smalloc(sizeof(char *) * count);
+	uint *refs, blk;
+	u_int32_t *ref;
+	int entries = 0, nrefs = 0, i, j;
 
-	read_blk(dquot->dq_h, blk, buf);
-	if (depth == QT_TREEDEPTH - 1) {
-		for (i = 0; i < QT_BLKSIZE >> 2; i++) {
-			blk = le32toh(ref[i]);
-			check_reference(dquot->dq_h, blk);
-			if (blk && !get_bit(bitmap, blk))
-				entries += report_block(dquot, blk, bitmap, process_dquot);
-		}
+	read_blk_batch(h, blks, count, buf, data);
+	if (depth == QT_TREEDEPTH) {
+		for (i = 0; i < count; i++)
+			entries += report_block(s, data[i]);
+		free(data);
+		free(buf);
+		return entries;
 	}
-	else {
-		for (i = 0; i < QT_BLKSIZE >> 2; i++)
-			if ((blk = le32toh(ref[i]))) {
-				check_reference(dquot->dq_h, blk);
-				entries +=
-					report_tree(dquot, blk, depth + 1, bitmap, process_dquot);
+	refs = smalloc(sizeof(uint) * count * (QT_BLKSIZE >> 2));
+	for (i = 0; i < count; i++) {
+		ref = (u_int32_t *)data[i];
+		for (j = 0; j < QT_BLKSIZE >> 2; j++) {
+			blk = le32toh(ref[j]);
+			check_reference(h, blk);
+			if (!blk)
+				continue;
+			/* Data block is reported when it is referenced for the first time */
+			if (depth == QT_TREEDEPTH - 1) {
+				if (get_bit(bitmap, blk))
+					continue;
+				set_bit(bitmap, blk);
 			}
+			refs[nrefs++] = blk;
+		}
 	}
-	freedqbuf(buf);
+	free(data);
+	free(buf);
+	for (i = 0; i < nrefs; i += QT_SCAN_BATCH)
+		entries += report_tree(s, refs + i, nrefs - i < QT_SCAN_BATCH ? nrefs - i : QT_SCAN_BATCH,
+				       depth + 1);
+	free(refs);
 	return entries;
 }
 
@@ -506,19 +1100,56 @@ static uint find_set_bits(char *bmp, int blocks)
 	return used;
 }
 
-int qtree_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *, char *))
+static int scan_tree(struct qtree_scan *s)
 {
-	char *bitmap;
-	struct v2_mem_dqinfo *v2info = &h->qh_info.u.v2_mdqi;
+	struct v2_mem_dqinfo *v2info = &s->h->qh_info.u.v2_mdqi;
 	struct qtree_mem_dqinfo *info = &v2info->dqi_qtree;
-	struct dquot *dquot = get_empty_dquot();
+	uint root = QT_TREEOFF;
 
-	dquot->dq_h = h;
-	bitmap = smalloc((info->dqi_blocks + 7) >> 3);
-	memset(bitmap, 0, (info->dqi_blocks + 7) >> 3);
-	v2info->dqi_used_entries = report_tree(dquot, QT_TREEOFF, 0, bitmap, process_dquot);
-	v2info->dqi_data_blocks = find_set_bits(bitmap, info->dqi_blocks);
-	free(bitmap);
-	free(dquot);
+	/* Blocks are read bypassing the cache */
+	if (qtree_flush_cache(s->h) < 0)
+		return -1;
+	s->bitmap = smalloc((info->dqi_blocks + 7) >> 3);
+	memset(s->bitmap, 0, (info->dqi_blocks + 7) >> 3);
+	v2info->dqi_used_entries = report_tree(s, &root, 1, 0);
+	v2info->dqi_data_blocks = find_set_bits(s->bitmap, info->dqi_blocks);
+	free(s->bitmap);
 	return 0;
 }
+
+int qtree_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *, char *))
+{
+	struct qtree_scan s;
+	int ret;
+
+	memset(&s, 0, sizeof(s));
+	s.h = h;
+	s.dquot = get_empty_dquot();
+	s.dquot->dq_h = h;
+	s.process_dquot = process_dquot;
+	ret = scan_tree(&s);
+	free(s.dquot);
+	return ret;
+}
+
+/* Scan the tree and pass found structures in batches */
+int qtree_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *))
+{
+	struct qtree_scan s;
+	int ret;
+
+	memset(&s, 0, sizeof(s));
+	s.h = h;
+	s.dquot = get_empty_dquot();
+	s.dquot->dq_h = h;
+	s.batch = get_empty_dquot_batch(h);
+	s.process_batch = process_batch;
+	ret = scan_tree(&s);
+	if (!ret && !s.err && flush_dquot_batch(s.batch, process_batch) < 0)
+		s.err = 1;
+	free(s.batch);
+	free(s.dquot);
+	if (s.err)
+		return -1;
+	return ret;
+}
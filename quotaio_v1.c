@@ -33,6 +33,7 @@ write_info:	v1_write_info,
 read_dquot:	v1_read_dquot,
 commit_dquot:	v1_commit_dquot,
 scan_dquots:	v1_scan_dquots,
+scan_dquots_batch:	generic_scan_dquots_batch,
 };
 
 /*
@@ -201,6 +202,8 @@ static struct dquot *v1_read_dquot(struct quota_handle *h, qid_t id)
 			free(dquot);
 			return NULL;
 		}
+	} else if (h->qh_map && V1_DQOFF(id) + sizeof(ddqblk) <= h->qh_map_len) {
+		v1_disk2memdqblk(&dquot->dq_dqb, (struct v1_disk_dqblk *)(h->qh_map + V1_DQOFF(id)));
 	} else {
 		lseek(h->qh_fd, (long)V1_DQOFF(id), SEEK_SET);
 		switch (read(h->qh_fd, &ddqblk, sizeof(ddqblk))) {
@@ -257,32 +260,41 @@ static int v1_commit_dquot(struct dquot *dquot, int flags)
  */
 #define SCANBUFSIZE 256
 
+static inline int v1_dqblk_empty(struct v1_disk_dqblk *ddqblk)
+{
+	return (ddqblk->dqb_ihardlimit | ddqblk->dqb_isoftlimit |
+		ddqblk->dqb_bhardlimit | ddqblk->dqb_bsoftlimit |
+		ddqblk->dqb_curblocks | ddqblk->dqb_curinodes |
+		ddqblk->dqb_itime | ddqblk->dqb_btime) == 0;
+}
+
 static int v1_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *, char *))
 {
 	int rd, scanbufpos = 0, scanbufsize = 0;
 	char scanbuf[sizeof(struct v1_disk_dqblk)*SCANBUFSIZE];
 	struct v1_disk_dqblk *ddqblk;
 	struct dquot *dquot = get_empty_dquot();
-	qid_t id = 0;
+	qid_t id;
 
 	memset(dquot, 0, sizeof(*dquot));
 	dquot->dq_h = h;
-	lseek(h->qh_fd, 0, SEEK_SET);
-	for(id = 0; ; id++, scanbufpos++) {
-		if (scanbufpos >= scanbufsize) {
-			rd = read(h->qh_fd, scanbuf, sizeof(scanbuf));
-			if (rd < 0 || rd % sizeof(struct v1_disk_dqblk))
-				goto out_err;
-			if (!rd)
-				break;
-			scanbufpos = 0;
-			scanbufsize = rd / sizeof(struct v1_disk_dqblk);
+	for (id = 0; ; id++, scanbufpos++) {
+		if (h->qh_map && V1_DQOFF(id) + sizeof(struct v1_disk_dqblk) <= h->qh_map_len) {
+			/* Mapped part of the file is processed in place */
+			ddqblk = (struct v1_disk_dqblk *)(h->qh_map + V1_DQOFF(id));
+		} else {
+			if (scanbufpos >= scanbufsize) {
+				rd = pread(h->qh_fd, scanbuf, sizeof(scanbuf), V1_DQOFF(id));
+				if (rd < 0 || rd % sizeof(struct v1_disk_dqblk))
+					goto out_err;
+				if (!rd)
+					break;
+				scanbufpos = 0;
+				scanbufsize = rd / sizeof(struct v1_disk_dqblk);
+			}
+			ddqblk = ((struct v1_disk_dqblk *)scanbuf) + scanbufpos;
 		}
-		ddqblk = ((struct v1_disk_dqblk *)scanbuf) + scanbufpos;
-		if ((ddqblk->dqb_ihardlimit | ddqblk->dqb_isoftlimit |
-		     ddqblk->dqb_bhardlimit | ddqblk->dqb_bsoftlimit |
-		     ddqblk->dqb_curblocks | ddqblk->dqb_curinodes |
-		     ddqblk->dqb_itime | ddqblk->dqb_btime) == 0)
+		if (v1_dqblk_empty(ddqblk))
 			continue;
 		v1_disk2memdqblk(&dquot->dq_dqb, ddqblk);
 		dquot->dq_id = id;
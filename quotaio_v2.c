@@ -27,20 +27,30 @@ typedef char *dqbuf_t;
 static int v2_check_file(int fd, int type, int fmt);
 static int v2_init_io(struct quota_handle *h);
 static int v2_new_io(struct quota_handle *h);
+static int v2_end_io(struct quota_handle *h);
 static int v2_write_info(struct quota_handle *h);
 static struct dquot *v2_read_dquot(struct quota_handle *h, qid_t id);
+static int v2_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots);
 static int v2_commit_dquot(struct dquot *dquot, int flags);
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots, int count);
+static int v2_flush(struct quota_handle *h);
 static int v2_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *dquot, char *dqname));
+static int v2_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *batch));
 static int v2_report(struct quota_handle *h, int verbose);
 
 struct quotafile_ops quotafile_ops_2 = {
 check_file:	v2_check_file,
 init_io:	v2_init_io,
 new_io:		v2_new_io,
+end_io:		v2_end_io,
 write_info:	v2_write_info,
 read_dquot:	v2_read_dquot,
+read_dquots:	v2_read_dquots,
 commit_dquot:	v2_commit_dquot,
+commit_dquots:	v2_commit_dquots,
+flush:		v2_flush,
 scan_dquots:	v2_scan_dquots,
+scan_dquots_batch:	v2_scan_dquots_batch,
 report:	v2_report
 };
 
@@ -361,6 +371,18 @@ static int v2_new_io(struct quota_handle *h)
 	return 0;
 }
 
+/*
+ *	Write cached blocks and close quotafile
+ */
+static int v2_end_io(struct quota_handle *h)
+{
+	if (qtree_free_cache(h) < 0) {
+		errstr(_("Cannot write quota file on %s: %s\n"), h->qh_quotadev, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 /*
  *	Write information (grace times to file)
  */
@@ -407,6 +429,16 @@ static struct dquot *v2_read_dquot(struct quota_handle *h, qid_t id)
 	return qtree_read_dquot(h, id);
 }
 
+/*
+ *  Read dquots for several ids
+ */
+static int v2_read_dquots(struct quota_handle *h, qid_t *ids, int count, struct dquot **dquots)
+{
+	if (QIO_ENABLED(h))
+		return kernel_read_dquots(h, ids, count, dquots);
+	return qtree_read_dquots(h, ids, count, dquots);
+}
+
 /* 
  *  Commit changes of dquot to disk - it might also mean deleting it when quota became fake one and user has no blocks...
  *  User can process use 'errno' to detect errstr
@@ -427,13 +459,50 @@ static int v2_commit_dquot(struct dquot *dquot, int flags)
 	}
 	if (!b->dqb_curspace && !b->dqb_curinodes && !b->dqb_bsoftlimit && !b->dqb_isoftlimit
 	    && !b->dqb_bhardlimit && !b->dqb_ihardlimit)
-		qtree_delete_dquot(dquot);
-	else {
-		if (check_dquot_range(dquot) < 0) {
-			errno = ERANGE;
-			return -1;
-		}
-		qtree_write_dquot(dquot);
+		return qtree_delete_dquot(dquot);
+	if (check_dquot_range(dquot) < 0) {
+		errno = ERANGE;
+		return -1;
+	}
+	return qtree_write_dquot(dquot);
+}
+
+/*
+ *  Write all dquots to a newly created quotafile. Data is written in a few
+ *  large writes and synced to disk together with the info header.
+ */
+static int v2_commit_dquots(struct quota_handle *h, struct dquot **dquots, int count)
+{
+	if (QIO_RO(h)) {
+		errstr(_("Trying to write quota to readonly quotafile on %s\n"), h->qh_quotadev);
+		errno = EPERM;
+		return -1;
+	}
+	if (QIO_ENABLED(h)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (qtree_write_dquots(h, dquots, count) < 0)
+		return -1;
+	if (v2_write_info(h) < 0)
+		return -1;
+	h->qh_io_flags &= ~IOFL_INFODIRTY;
+	if (fsync(h->qh_fd) < 0)
+		return -1;
+	return 0;
+}
+
+/*
+ *  Write cached tree blocks. Info is written afterwards by end_batch() or
+ *  end_io() so it never refers to blocks which are not written yet.
+ */
+static int v2_flush(struct quota_handle *h)
+{
+	if (QIO_ENABLED(h) || QIO_RO(h))
+		return 0;
+	if (qtree_end_batch(h) < 0) {
+		errstr(_("Cannot write quota file on %s: %s\n"), h->qh_quotadev, strerror(errno));
+		return -1;
 	}
 	return 0;
 }
@@ -443,6 +512,11 @@ static int v2_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct d
 	return qtree_scan_dquots(h, process_dquot);
 }
 
+static int v2_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *))
+{
+	return qtree_scan_dquots_batch(h, process_batch);
+}
+
 /* Report information about quotafile */
 static int v2_report(struct quota_handle *h, int verbose)
 {
@@ -31,14 +31,17 @@ static int xfs_write_info(struct quota_handle *h);
 static struct dquot *xfs_read_dquot(struct quota_handle *h, qid_t id);
 static int xfs_commit_dquot(struct dquot *dquot, int flags);
 static int xfs_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct dquot *dquot, char *dqname));
+static int xfs_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *batch));
 static int xfs_report(struct quota_handle *h, int verbose);
 
 struct quotafile_ops quotafile_ops_xfs = {
 init_io:	xfs_init_io,
 write_info:	xfs_write_info,
 read_dquot:	xfs_read_dquot,
+read_dquots:	kernel_read_dquots,
 commit_dquot:	xfs_commit_dquot,
 scan_dquots:	xfs_scan_dquots,
+scan_dquots_batch:	xfs_scan_dquots_batch,
 report:		xfs_report
 };
 
@@ -293,6 +296,49 @@ static int xfs_scan_dquots(struct quota_handle *h, int (*process_dquot) (struct
 	return xfs_kernel_scan_dquots(h, process_dquot);
 }
 
+/*
+ *	Scan all known dquots and call callback on batches of them
+ */
+static int xfs_scan_dquots_batch(struct quota_handle *h, int (*process_batch) (struct dquot_batch *batch))
+{
+	struct dquot_batch *b;
+	struct xfs_kern_dqblk xdqblk;
+	struct util_dqblk dqb;
+	qid_t id = 0;
+	int ret;
+
+	ret = quotactl_handle(Q_XGETNEXTQUOTA, h, 0, (void *)&xdqblk);
+	if (ret < 0 && (errno == ENOSYS || errno == EINVAL)) {
+		if (!XFS_USRQUOTA(h) && !XFS_GRPQUOTA(h) && !XFS_PRJQUOTA(h))
+			return 0;
+		return generic_scan_dquots_batch(h, process_batch);
+	}
+
+	b = get_empty_dquot_batch(h);
+	while (1) {
+		ret = quotactl_handle(Q_XGETNEXTQUOTA, h, id, (void *)&xdqblk);
+		if (ret < 0)
+			break;
+
+		xfs_kern2utildqblk(&dqb, &xdqblk);
+		dquot_batch_add(b, xdqblk.d_id, &dqb);
+		if (b->db_count == DQ_BATCH_SIZE && flush_dquot_batch(b, process_batch) < 0) {
+			free(b);
+			return -1;
+		}
+		id = xdqblk.d_id + 1;
+		/* id -1 is invalid and the last one... */
+		if (id == -1) {
+			errno = ENOENT;
+			break;
+		}
+	}
+	if (errno == ENOENT)
+		ret = flush_dquot_batch(b, process_batch);
+	free(b);
+	return ret;
+}
+
 /*
  *	Report information about XFS quota on given filesystem
  */
@@ -159,6 +159,65 @@ out_err:
 	return qhead;
 }
 
+/*
+ * Collect the requested quota information for each id separately.
+ */
+static int getprivs_each(qid_t *ids, int count, struct quota_handle **handles, int ignore_noquota,
+			 struct dquot **privs)
+{
+	int j;
+
+	for (j = 0; j < count; j++) {
+		if (!(privs[j] = getprivs(ids[j], handles, ignore_noquota))) {
+			while (--j >= 0)
+				freeprivs(privs[j]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Collect the requested quota information for several ids. Lists of dquots
+ * for each id are stored in privs.
+ */
+int getprivs_batch(qid_t *ids, int count, struct quota_handle **handles, int ignore_noquota,
+		   struct dquot **privs)
+{
+	struct dquot **dquots, *q;
+	int i, j, found = 0;
+
+#if defined(BSD_BEHAVIOUR)
+	/* Permissions are checked for each id */
+	if (geteuid() != 0)
+		return getprivs_each(ids, count, handles, ignore_noquota, privs);
+#endif
+	memset(privs, 0, sizeof(struct dquot *) * count);
+	dquots = smalloc(sizeof(struct dquot *) * count);
+	/* Walk handles backwards so that lists are in the order of handles */
+	for (i = 0; handles[i]; i++);
+	while (--i >= 0) {
+		if (read_dquots(handles[i], ids, count, dquots) < 0) {
+			if (ignore_noquota && (errno == ENOENT || errno == ECONNREFUSED))
+				continue;
+			for (j = 0; j < count; j++)
+				freeprivs(privs[j]);
+			free(dquots);
+			/* Read ids one by one to report which one failed */
+			return getprivs_each(ids, count, handles, ignore_noquota, privs);
+		}
+		for (j = 0; j < count; j++) {
+			q = dquots[j];
+			q->dq_next = privs[j];
+			privs[j] = q;
+		}
+		found = 1;
+	}
+	free(dquots);
+	/* Like getprivs(), fail when there's nothing to update */
+	return found ? 0 : -1;
+}
+
 /*
  * Store the requested quota information.
  */
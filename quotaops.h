@@ -4,6 +4,7 @@
 #include "quotaio.h"
 
 struct dquot *getprivs(qid_t id, struct quota_handle ** handles, int quiet);
+int getprivs_batch(qid_t * ids, int count, struct quota_handle ** handles, int quiet, struct dquot ** privs);
 int putprivs(struct dquot * qlist, int flags);
 int editprivs(char *tmpfile);
 int writeprivs(struct dquot * qlist, int outfd, char *name, int quotatype);
@@ -365,6 +365,22 @@ static int output(struct dquot *dquot, char *name)
 	return 0;
 }
 
+/* Callback routine called by scan_dquots_batch on each batch of dquots */
+static int output_batch(struct dquot_batch *b)
+{
+	struct dquot dquot;
+	int i;
+
+	for (i = 0; i < b->db_count; i++) {
+		/* Don't bother with entries which won't be printed */
+		if (!b->db_curspace[i] && !b->db_curinodes[i] && !(flags & FL_VERBOSE))
+			continue;
+		dquot_batch_get(b, i, &dquot);
+		output(&dquot, b->db_name[i]);
+	}
+	return 0;
+}
+
 /* Dump information stored in one quota file */
 static void report_it(struct quota_handle *h, int type)
 {
@@ -407,7 +423,7 @@ static void report_it(struct quota_handle *h, int type)
 			typestr,spacehdr, spacehdr, spacehdr, spacehdr, spacehdr);
 	}
 
-	if (h->qh_ops->scan_dquots(h, output) < 0)
+	if (scan_dquots_batch(h, output_batch) < 0)
 		return;
 	dump_cached_dquots(type);
 	if (ofmt == QOF_DEFAULT) {
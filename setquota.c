@@ -354,7 +354,10 @@ out:
 
 #define MAXLINELEN 65536
 
-/* Read & parse one batch entry */
+/*
+ * Read & parse one batch entry. Returns 0 on success, -1 on end of input and
+ * 1 when the line cannot be parsed and we should not continue.
+ */
 static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize_t *bsoftlimit, qsize_t *bhardlimit)
 {
 	static int line = 0;
@@ -369,8 +372,10 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 		line++;
 		if (!fgets(linebuf, sizeof(linebuf), stdin))
 			return -1;
-		if (linebuf[strlen(linebuf)-1] != '\n')
-			die(1, _("Line %d too long.\n"), line);
+		if (linebuf[strlen(linebuf)-1] != '\n') {
+			errstr(_("Line %d too long.\n"), line);
+			return 1;
+		}
 		/* Comment? */
 		if (linebuf[0] == '#')
 			continue;
@@ -384,7 +389,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 		if (ret != 5) {
 			errstr(_("Cannot parse input line %d.\n"), line);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -392,7 +397,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 		if (ret) {
 			errstr(_("Unable to resolve name '%s' on line %d.\n"), name, line);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -401,7 +406,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 			errstr(_("Unable to parse block soft limit '%s' "
 				    "on line %d: %s\n"), bs, line, error);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -410,7 +415,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 			errstr(_("Unable to parse block hard limit '%s' "
 				    "on line %d: %s\n"), bh, line, error);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -419,7 +424,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 			errstr(_("Unable to parse inode soft limit '%s' "
 				    "on line %d: %s\n"), is, line, error);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -428,7 +433,7 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 			errstr(_("Unable to parse inode hard limit '%s' "
 				    "on line %d: %s\n"), ih, line, error);
 			if (!(flags & FL_CONTINUE_BATCH))
-				die(1, _("Exitting.\n"));
+				return 1;
 			errstr(_("Skipping line.\n"));
 			continue;
 		}
@@ -437,30 +442,78 @@ static int read_entry(qid_t *id, qsize_t *isoftlimit, qsize_t *ihardlimit, qsize
 	return 0;
 }
 
+/* Limits from one line of input */
+struct batch_entry {
+	qid_t id;
+	qsize_t bhardlimit, bsoftlimit, ihardlimit, isoftlimit;
+};
+
+#define BATCH_ENTRIES 256	/* Number of input lines whose quotas are looked up at once */
+
 /* Set user limits in batch mode */
 static int batch_setlimits(struct quota_handle **handles)
 {
-	struct dquot *curprivs, *q;
-	qsize_t bhardlimit, bsoftlimit, ihardlimit, isoftlimit;
-	qid_t id;
-	int ret = 0;
-
-	while (!read_entry(&id, &isoftlimit, &ihardlimit, &bsoftlimit, &bhardlimit)) {
-		curprivs = getprivs(id, handles, !!(flags & FL_ALL));
-		if (!curprivs) {
+	struct batch_entry entries[BATCH_ENTRIES], *e;
+	struct dquot *curprivs[BATCH_ENTRIES], *q;
+	qid_t ids[BATCH_ENTRIES];
+	int cnt = 0, pending = 0, eof = 0, parse_err = 0, ret = 0, err, i;
+
+	while (!eof || pending) {
+		/*
+		 * Read a batch of entries. Each id can be in the batch only
+		 * once, entry with repeated id starts the next batch.
+		 */
+		cnt = pending;
+		pending = 0;
+		while (cnt < BATCH_ENTRIES && !eof) {
+			e = entries + cnt;
+			err = read_entry(&e->id, &e->isoftlimit, &e->ihardlimit, &e->bsoftlimit, &e->bhardlimit);
+			if (err) {
+				/* Apply lines read so far before bailing out */
+				if (err > 0)
+					parse_err = 1;
+				eof = 1;
+				break;
+			}
+			for (i = 0; i < cnt && ids[i] != e->id; i++);
+			if (i < cnt) {
+				pending = 1;
+				break;
+			}
+			ids[cnt++] = e->id;
+		}
+		if (!cnt)
+			break;
+		if (getprivs_batch(ids, cnt, handles, !!(flags & FL_ALL), curprivs) < 0) {
 			errstr(_("Error getting quota information to update.\n"));
 			return -1;
 		}
-		for (q = curprivs; q; q = q->dq_next) {
-			q->dq_dqb.dqb_bsoftlimit = bsoftlimit;
-			q->dq_dqb.dqb_bhardlimit = bhardlimit;
-			q->dq_dqb.dqb_isoftlimit = isoftlimit;
-			q->dq_dqb.dqb_ihardlimit = ihardlimit;
-			update_grace_times(q);
+		/* Write changes of the whole batch together */
+		for (i = 0; handles[i]; i++)
+			begin_batch(handles[i]);
+		for (i = 0; i < cnt; i++) {
+			for (q = curprivs[i]; q; q = q->dq_next) {
+				q->dq_dqb.dqb_bsoftlimit = entries[i].bsoftlimit;
+				q->dq_dqb.dqb_bhardlimit = entries[i].bhardlimit;
+				q->dq_dqb.dqb_isoftlimit = entries[i].isoftlimit;
+				q->dq_dqb.dqb_ihardlimit = entries[i].ihardlimit;
+				update_grace_times(q);
+			}
+			if (putprivs(curprivs[i], COMMIT_LIMITS) == -1)
+				ret = -1;
+			freeprivs(curprivs[i]);
 		}
-		if (putprivs(curprivs, COMMIT_LIMITS) == -1)
-			ret = -1;
-		freeprivs(curprivs);
+		for (i = 0; handles[i]; i++)
+			if (end_batch(handles[i]) < 0)
+				ret = -1;
+		if (pending) {
+			entries[0] = entries[cnt];
+			ids[0] = entries[0].id;
+		}
+	}
+	if (parse_err) {
+		errstr(_("Exitting.\n"));
+		ret = -1;
 	}
 	return ret;
 }
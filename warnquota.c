@@ -305,12 +305,18 @@ static int deliverable(struct dquot *dquot)
 	return 1;
 }
 
-static int check_offence(struct dquot *dquot, char *name)
+static int check_offence(struct dquot_batch *b)
 {
-	if ((dquot->dq_dqb.dqb_bsoftlimit && toqb(dquot->dq_dqb.dqb_curspace) >= dquot->dq_dqb.dqb_bsoftlimit)
-	    || (dquot->dq_dqb.dqb_isoftlimit && dquot->dq_dqb.dqb_curinodes >= dquot->dq_dqb.dqb_isoftlimit)) {
-		if(deliverable(dquot))
-			add_offence(dquot, name);
+	struct dquot dquot;
+	int i;
+
+	for (i = 0; i < b->db_count; i++) {
+		if ((!b->db_bsoftlimit[i] || toqb(b->db_curspace[i]) < b->db_bsoftlimit[i])
+		    && (!b->db_isoftlimit[i] || b->db_curinodes[i] < b->db_isoftlimit[i]))
+			continue;
+		dquot_batch_get(b, i, &dquot);
+		if(deliverable(&dquot))
+			add_offence(&dquot, b->db_name[i]);
 	}
 	return 0;
 }
@@ -1075,7 +1081,7 @@ static void warn_quota(int fs_count, char **fs)
 		else
 			maildev_handle = find_handle_dev(maildev, handles);
 		for (i = 0; handles[i]; i++)
-			handles[i]->qh_ops->scan_dquots(handles[i], check_offence);
+			scan_dquots_batch(handles[i], check_offence);
 		dispose_handle_list(handles);
 	}
 	if (flags & FL_GROUP) {
@@ -1087,7 +1093,7 @@ static void warn_quota(int fs_count, char **fs)
 		else
 			maildev_handle = find_handle_dev(maildev, handles);
 		for (i = 0; handles[i]; i++)
-			handles[i]->qh_ops->scan_dquots(handles[i], check_offence);
+			scan_dquots_batch(handles[i], check_offence);
 		dispose_handle_list(handles);
 	}
 	if (mail_to_offenders(&config) < 0)